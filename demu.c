@@ -45,9 +45,10 @@
 #include <inttypes.h>
 #include <pthread.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
@@ -66,6 +67,7 @@
 #include "debug.h"
 #include "device.h"
 #include "demu.h"
+#include "mapcache.h"
 #include "xs_dev.h"
 
 #include "kvm/kvm.h"
@@ -86,6 +88,8 @@ bool do_debug_print = true;
 
 #define __max(_x, _y) (((_x) > (_y)) ? (_x) : (_y))
 
+#define DEMU_MAX_EVENTS 16
+
 typedef enum {
     DEMU_SEQ_UNINITIALIZED = 0,
     DEMU_SEQ_XENSTORE_ATTACHED,
@@ -93,15 +97,15 @@ typedef enum {
     DEMU_SEQ_XENFOREIGNMEMORY_OPEN,
     DEMU_SEQ_XENDEVICEMODEL_OPEN,
     DEMU_SEQ_XENGNTTAB_OPEN,
+    DEMU_SEQ_MAPCACHE_CREATED,
     DEMU_SEQ_SERVER_REGISTERED,
     DEMU_SEQ_RESOURCE_MAPPED,
     DEMU_SEQ_SERVER_ENABLED,
     DEMU_SEQ_PORT_ARRAY_ALLOCATED,
     DEMU_SEQ_PORTS_BOUND,
-#ifdef MAP_IN_ADVANCE
     DEMU_SEQ_GUEST_RAM_MAPPED,
-#endif
     DEMU_SEQ_DEVICE_INITIALIZED,
+    DEMU_SEQ_VCPU_THREADS_STARTED,
     DEMU_SEQ_INITIALIZED,
     DEMU_NR_SEQS
 } demu_seq_t;
@@ -116,6 +120,31 @@ struct demu_space {
     void			*ptr;
 };
 
+typedef struct demu_fd demu_fd_t;
+
+struct demu_fd {
+    demu_fd_t   *next;
+    int         fd;
+    int         (*fn)(void *ptr);
+    void        *ptr;
+};
+
+/* See demu_get_ram_chunks() */
+typedef struct demu_ram_chunk {
+    unsigned int    gen;
+    unsigned int    users;
+    unsigned int    nr_bad;
+} demu_ram_chunk_t;
+
+typedef struct demu_ram_bank {
+    uint64_t            base;
+    uint64_t            size;
+    void                *va;
+    demu_ram_chunk_t    *chunk;
+    /* Bitmap of the pages found unpopulated by the last remap */
+    uint64_t            *bad;
+} demu_ram_bank_t;
+
 typedef struct demu_state {
     demu_seq_t                       seq;
     xenevtchn_handle                 *xeh;
@@ -123,13 +152,33 @@ typedef struct demu_state {
     xendevicemodel_handle            *xdh;
     xengnttab_handle                 *xgt;
     int                              use_gnttab;
+    uint64_t                         mapcache_size;
+    struct mapcache                  *mapcache;
+    uint64_t                         gntcache_size;
+    struct mapcache                  *gntcache;
+    bool                             gntcache_on;
+    int                              map_in_advance;
+    demu_ram_bank_t                  *ram_bank;
+    unsigned int                     nr_ram_banks;
+    unsigned int                     ram_gen;
     domid_t                          domid;
     domid_t                          be_domid;
     unsigned int                     vcpus;
     ioservid_t                       ioservid;
     xenforeignmemory_resource_handle *resource;
     shared_iopage_t                  *shared_iopage;
+    buffered_iopage_t                *buffered_iopage;
+    evtchn_port_t                    bufioreq_port;
+    int                              bufioreq_local_port;
     evtchn_port_t                    *ioreq_local_port;
+    bool                             vcpu_threads;
+    xenevtchn_handle                 **vcpu_xeh;
+    pthread_t                        *vcpu_thread;
+    int                              vcpu_stop_fd;
+    int                              *port_vcpu;
+    unsigned int                     nr_port_vcpu;
+    int                              epfd;
+    demu_fd_t                        *fds;
     demu_space_t                     *memory;
     struct xs_dev                    *xs_dev;
 } demu_state_t;
@@ -143,6 +192,31 @@ demu_set_irq(int irq, int level)
                                  irq, level);
 }
 
+/* Event channel fds are non-blocking, so that pending ports can be drained */
+static xenevtchn_handle *demu_open_xenevtchn(void)
+{
+    xenevtchn_handle    *xeh;
+    int                 flags;
+
+    xeh = xenevtchn_open(NULL, 0);
+    if (xeh == NULL)
+        return NULL;
+
+    flags = fcntl(xenevtchn_fd(xeh), F_GETFL);
+    if (flags < 0 ||
+        fcntl(xenevtchn_fd(xeh), F_SETFL, flags | O_NONBLOCK) < 0) {
+        xenevtchn_close(xeh);
+        return NULL;
+    }
+
+    return xeh;
+}
+
+static xenevtchn_handle *demu_vcpu_xeh(unsigned int i)
+{
+    return demu_state.vcpu_xeh ? demu_state.vcpu_xeh[i] : demu_state.xeh;
+}
+
 static void *demu_map_guest_pages(xen_pfn_t pfn[], unsigned int n, int prot)
 {
     void *ptr;
@@ -189,7 +263,141 @@ static void demu_unmap_guest_grant_refs(void *ptr, unsigned int n)
 
 #define XEN_GRANT_ADDR_OFF   (1ULL << 63)
 
-#ifndef MAP_IN_ADVANCE
+/* Pre-mapped guest RAM is revalidated in 2M chunks */
+#define GUEST_RAM_CHUNK_SHIFT   21
+#define GUEST_RAM_CHUNK_SIZE    (1ull << GUEST_RAM_CHUNK_SHIFT)
+
+/* Foreign mappings are cached in 64K buckets */
+#define MAPCACHE_BUCKET_SHIFT   4
+
+static void *demu_mapcache_map_pages(uint64_t frame, unsigned int n, int prot,
+                                     void *opaque)
+{
+    xen_pfn_t   *pfn;
+    unsigned int i;
+    void        *ptr;
+
+    pfn = malloc(sizeof(xen_pfn_t) * n);
+    if (pfn == NULL)
+        return NULL;
+
+    for (i = 0; i < n; i++)
+        pfn[i] = frame + i;
+
+    ptr = demu_map_guest_pages(pfn, n, prot);
+    free(pfn);
+
+    return ptr;
+}
+
+static void demu_mapcache_unmap_pages(void *ptr, unsigned int n, void *opaque)
+{
+    demu_unmap_guest_pages(ptr, n);
+}
+
+static const struct mapcache_ops demu_mapcache_ops = {
+    .map = demu_mapcache_map_pages,
+    .unmap = demu_mapcache_unmap_pages,
+};
+
+/*
+ * The frontend cannot end foreign access to a grant while we keep it
+ * mapped: grants are only cached for frontends which said they keep them
+ * granted, see demu_frontend_started().
+ */
+static void *demu_gntcache_map_refs(uint64_t frame, unsigned int n, int prot,
+                                    void *opaque)
+{
+    uint32_t    *grants;
+    unsigned int i;
+    void        *ptr;
+
+    grants = malloc(sizeof (uint32_t) * n);
+    if (grants == NULL)
+        return NULL;
+
+    for (i = 0; i < n; i++)
+        grants[i] = frame + i;
+
+    ptr = demu_map_guest_grant_refs(grants, n, prot);
+    free(grants);
+
+    return ptr;
+}
+
+static void demu_gntcache_unmap_refs(void *ptr, unsigned int n, void *opaque)
+{
+    demu_unmap_guest_grant_refs(ptr, n);
+}
+
+static const struct mapcache_ops demu_gntcache_ops = {
+    .map = demu_gntcache_map_refs,
+    .unmap = demu_gntcache_unmap_refs,
+};
+
+/* The grant cache, if the current frontend lets us keep grants mapped */
+static struct mapcache *demu_gntcache(void)
+{
+    if (!__atomic_load_n(&demu_state.gntcache_on, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return demu_state.gntcache;
+}
+
+/*
+ * Called when the driver starts the device (DRIVER_OK) and when it resets
+ * it. Like with blkback's persistent grants, the frontend has to opt in,
+ * by writing feature-persistent = 1 in its node before starting the
+ * device: it promises not to end foreign access to the grants it hands
+ * out until the device is reset. The node is read again on every start,
+ * as the frontend may have changed (e.g. after a kexec).
+ *
+ * Upstream virtio frontends don't opt in: Linux's grant DMA ops end
+ * foreign access as soon as a buffer is unmapped. Their grants are
+ * unmapped as soon as each request is done.
+ */
+void
+demu_frontend_started(bool started)
+{
+    int val;
+
+    if (demu_state.gntcache == NULL)
+        return;
+
+    if (started) {
+        if (xenstore_read_fe_int(demu_state.xs_dev, "feature-persistent",
+                                 &val) < 0 || !val) {
+            DBG("Frontend does not keep grants, not caching them\n");
+            return;
+        }
+
+        DBG("Frontend keeps grants, caching them\n");
+        __atomic_store_n(&demu_state.gntcache_on, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* Mappings still in use go away once released */
+    __atomic_store_n(&demu_state.gntcache_on, false, __ATOMIC_RELEASE);
+    mapcache_invalidate(demu_state.gntcache);
+}
+
+static void demu_destroy_mapcache(struct mapcache **mcp)
+{
+    struct mapcache_stats stats;
+
+    if (*mcp == NULL)
+        return;
+
+    mapcache_get_stats(*mcp, &stats);
+    DBG("%"PRIu64" hits %"PRIu64" misses %"PRIu64" evictions "
+        "%"PRIu64" uncached %"PRIu64" invalidated\n",
+        stats.hits, stats.misses, stats.evictions,
+        stats.uncached, stats.invalidated);
+
+    mapcache_destroy(*mcp);
+    *mcp = NULL;
+}
+
 static void demu_detect_mappings_model(uint64_t addr)
 {
     if (demu_state.use_gnttab >= 0)
@@ -200,8 +408,369 @@ static void demu_detect_mappings_model(uint64_t addr)
     DBG("Use %s mapping (addr 0x%lx)\n",
         demu_state.use_gnttab > 0 ? "grant" : "foreign", addr);
 }
+
+static int demu_add_guest_ram(uint64_t base, uint64_t size)
+{
+    demu_ram_bank_t *bank;
+
+    bank = realloc(demu_state.ram_bank,
+                   sizeof (demu_ram_bank_t) * (demu_state.nr_ram_banks + 1));
+    if (bank == NULL)
+        return -1;
+
+    demu_state.ram_bank = bank;
+    demu_state.ram_bank[demu_state.nr_ram_banks++] = (demu_ram_bank_t) {
+        .base = base,
+        .size = size,
+    };
+
+    return 0;
+}
+
+#ifdef GUEST_RAM_BANKS
+/*
+ * The toolstack fills the architectural RAM banks (see
+ * include/public/arch-arm.h) in order, up to the configured memory size.
+ */
+static int demu_discover_guest_ram(void)
+{
+    static const uint64_t bank_base[] = GUEST_RAM_BANK_BASES;
+    static const uint64_t bank_size[] = GUEST_RAM_BANK_SIZES;
+    uint64_t    mem, size;
+    int         i;
+
+    mem = xenstore_get_dom_mem(demu_state.xs_dev, demu_state.domid);
+    if (mem == 0)
+        return -1;
+
+    for (i = 0; i < GUEST_RAM_BANKS && mem != 0; i++) {
+        size = mem < bank_size[i] ? mem : bank_size[i];
+
+        if (demu_add_guest_ram(bank_base[i], size) < 0)
+            return -1;
+
+        mem -= size;
+    }
+
+    return 0;
+}
+#else
+#define E820MAX 128
+
+/* Use the memory map the toolstack handed to the guest */
+static int demu_discover_guest_ram(void)
+{
+    struct e820entry    map[E820MAX];
+    xc_interface        *xch;
+    int                 i, n;
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if (xch == NULL)
+        return -1;
+
+    n = xc_domain_get_memory_map(xch, demu_state.domid, map, E820MAX);
+    xc_interface_close(xch);
+
+    if (n < 0)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if (map[i].type != E820_RAM)
+            continue;
+
+        if (demu_add_guest_ram(map[i].addr & TARGET_PAGE_MASK,
+                               P2ROUNDUP(map[i].size, TARGET_PAGE_SIZE)) < 0)
+            return -1;
+    }
+
+    return 0;
+}
 #endif
 
+static void demu_unmap_guest_ram(void)
+{
+    demu_ram_bank_t *bank;
+    unsigned int    i;
+
+    for (i = 0; i < demu_state.nr_ram_banks; i++) {
+        bank = &demu_state.ram_bank[i];
+        if (bank->va == NULL)
+            continue;
+
+        demu_unmap_guest_pages(bank->va, bank->size >> TARGET_PAGE_SHIFT);
+        DBG("Unmapped guest ram%u va %p\n", i, bank->va);
+    }
+
+    for (i = 0; i < demu_state.nr_ram_banks; i++) {
+        free(demu_state.ram_bank[i].chunk);
+        free(demu_state.ram_bank[i].bad);
+    }
+
+    free(demu_state.ram_bank);
+    demu_state.ram_bank = NULL;
+    demu_state.nr_ram_banks = 0;
+}
+
+/*
+ * IOREQ_TYPE_INVALIDATE does not say which part of the p2m changed
+ * (ballooning, hotplug...), so all foreign mappings are suspect. Pre-mapped
+ * banks are only marked stale and remapped chunk by chunk when next used
+ * (and no longer in use), cached mappings are dropped. Grant mappings are
+ * not affected.
+ */
+static void demu_invalidate_guest_mappings(void)
+{
+    if (demu_state.nr_ram_banks)
+        __atomic_add_fetch(&demu_state.ram_gen, 1, __ATOMIC_SEQ_CST);
+
+    if (demu_state.mapcache)
+        mapcache_invalidate(demu_state.mapcache);
+
+    DBG("Guest mappings invalidated\n");
+}
+
+static int demu_compare_ram_bank(const void *a, const void *b)
+{
+    const demu_ram_bank_t *x = a, *y = b;
+
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+static int demu_map_guest_ram(void)
+{
+    demu_ram_bank_t *bank;
+    xen_pfn_t       *pfn;
+    unsigned int    i, j, n;
+
+    if (demu_discover_guest_ram() < 0 || demu_state.nr_ram_banks == 0) {
+        DBG("Cannot discover guest ram layout\n");
+        goto fail;
+    }
+
+    qsort(demu_state.ram_bank, demu_state.nr_ram_banks,
+          sizeof (demu_ram_bank_t), demu_compare_ram_bank);
+
+    for (i = 0; i < demu_state.nr_ram_banks; i++) {
+        bank = &demu_state.ram_bank[i];
+        n = bank->size >> TARGET_PAGE_SHIFT;
+
+        bank->chunk = calloc(P2ROUNDUP(bank->size, GUEST_RAM_CHUNK_SIZE) >>
+                             GUEST_RAM_CHUNK_SHIFT, sizeof (demu_ram_chunk_t));
+        bank->bad = calloc(P2ROUNDUP(n, 64) / 64, sizeof (uint64_t));
+        if (bank->chunk == NULL || bank->bad == NULL)
+            goto fail;
+
+        pfn = malloc(sizeof (xen_pfn_t) * n);
+        if (pfn == NULL)
+            goto fail;
+
+        for (j = 0; j < n; j++)
+            pfn[j] = (bank->base >> TARGET_PAGE_SHIFT) + j;
+
+        bank->va = demu_map_guest_pages(pfn, n, PROT_READ | PROT_WRITE);
+        free(pfn);
+
+        if (bank->va == NULL) {
+            DBG("Cannot map guest ram%u pa 0x%lx-0x%lx\n",
+                i, bank->base, bank->base + bank->size);
+            goto fail;
+        }
+
+        DBG("Mapped guest ram%u pa 0x%lx-0x%lx to va %p\n",
+            i, bank->base, bank->base + bank->size, bank->va);
+    }
+
+    return 0;
+
+fail:
+    demu_unmap_guest_ram();
+    return -1;
+}
+
+/*
+ * Remap a chunk of a bank in place. Only done when the caller's is the
+ * only reference on the chunk, so no pointer into it is in use across the
+ * remap. Pages the guest gave up are left inaccessible, and recorded.
+ */
+static int demu_remap_guest_ram(demu_ram_bank_t *bank, unsigned int chunk)
+{
+    static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+    demu_ram_chunk_t        *c = &bank->chunk[chunk];
+    xen_pfn_t               pfn[GUEST_RAM_CHUNK_SIZE >> TARGET_PAGE_SHIFT];
+    int                     err[GUEST_RAM_CHUNK_SIZE >> TARGET_PAGE_SHIFT];
+    uint64_t                offset = (uint64_t)chunk << GUEST_RAM_CHUNK_SHIFT;
+    uint64_t                size, page;
+    unsigned int            gen, i, n, nr_bad = 0;
+    void                    *ptr;
+
+    pthread_mutex_lock(&lock);
+
+    gen = __atomic_load_n(&demu_state.ram_gen, __ATOMIC_SEQ_CST);
+    if (c->gen == gen)
+        goto done;
+
+    if (__atomic_load_n(&c->users, __ATOMIC_SEQ_CST) != 1)
+        goto fail;
+
+    size = bank->size - offset;
+    if (size > GUEST_RAM_CHUNK_SIZE)
+        size = GUEST_RAM_CHUNK_SIZE;
+
+    n = size >> TARGET_PAGE_SHIFT;
+    for (i = 0; i < n; i++)
+        pfn[i] = ((bank->base + offset) >> TARGET_PAGE_SHIFT) + i;
+
+    ptr = xenforeignmemory_map2(demu_state.xfh, demu_state.domid,
+                                bank->va + offset, PROT_READ | PROT_WRITE,
+                                MAP_FIXED, n, pfn, err);
+    if (ptr == NULL) {
+        DBG("Cannot remap guest ram pa 0x%lx count %u\n",
+            bank->base + offset, n);
+        goto fail;
+    }
+
+    for (i = 0; i < n; i++) {
+        page = (offset >> TARGET_PAGE_SHIFT) + i;
+        if (err[i]) {
+            bank->bad[page / 64] |= 1ull << (page % 64);
+            nr_bad++;
+        } else {
+            bank->bad[page / 64] &= ~(1ull << (page % 64));
+        }
+    }
+
+    if (nr_bad)
+        DBG("%u pages at pa 0x%lx are not populated\n",
+            nr_bad, bank->base + offset);
+
+    c->nr_bad = nr_bad;
+    __atomic_store_n(&c->gen, gen, __ATOMIC_RELEASE);
+
+done:
+    pthread_mutex_unlock(&lock);
+    return 0;
+
+fail:
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+
+static void demu_put_ram_chunks(demu_ram_bank_t *bank, unsigned int first,
+                                unsigned int last)
+{
+    unsigned int    i;
+
+    for (i = first; i <= last; i++)
+        __atomic_sub_fetch(&bank->chunk[i].users, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a reference on the chunks covering [offset, offset + size) of a
+ * bank, for as long as the pointer into them is in use. Chunks invalidated
+ * since they were last used are remapped on the way, unless someone else
+ * still uses them. Returns false, with no reference held, if a chunk is
+ * busy or the range covers pages the guest gave up: the caller then needs
+ * a mapping of its own.
+ */
+static bool demu_get_ram_chunks(demu_ram_bank_t *bank, uint64_t offset,
+                                uint64_t size)
+{
+    unsigned int    first = offset >> GUEST_RAM_CHUNK_SHIFT;
+    unsigned int    last = (offset + size - 1) >> GUEST_RAM_CHUNK_SHIFT;
+    unsigned int    i, gen;
+    uint64_t        page;
+
+    for (i = first; i <= last; i++) {
+        demu_ram_chunk_t *c = &bank->chunk[i];
+
+        /*
+         * Counted before the generation is checked: a remap, which needs
+         * the chunk to itself, either sees us or is over by then.
+         */
+        __atomic_add_fetch(&c->users, 1, __ATOMIC_SEQ_CST);
+        gen = __atomic_load_n(&demu_state.ram_gen, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&c->gen, __ATOMIC_ACQUIRE) != gen &&
+            demu_remap_guest_ram(bank, i) < 0) {
+            demu_put_ram_chunks(bank, first, i);
+            return false;
+        }
+    }
+
+    for (i = first; i <= last; i++) {
+        if (!bank->chunk[i].nr_bad)
+            continue;
+
+        for (page = offset >> TARGET_PAGE_SHIFT;
+             page <= (offset + size - 1) >> TARGET_PAGE_SHIFT; page++) {
+            if (bank->bad[page / 64] & (1ull << (page % 64))) {
+                demu_put_ram_chunks(bank, first, last);
+                return false;
+            }
+        }
+        break;
+    }
+
+    return true;
+}
+
+/*
+ * Banks are sorted by guest address, so a binary search finds the owner.
+ * The pointer returned must be given back with demu_put_host_addr().
+ */
+static void *demu_get_host_addr(uint64_t addr, uint64_t size)
+{
+    demu_ram_bank_t *bank;
+    unsigned int    lo = 0, hi = demu_state.nr_ram_banks;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        bank = &demu_state.ram_bank[mid];
+        if (addr < bank->base)
+            hi = mid;
+        else if (addr >= bank->base + bank->size)
+            lo = mid + 1;
+        else
+            goto found;
+    }
+
+    return NULL;
+
+found:
+    if (size == 0)
+        size = 1;
+
+    if (bank->va == NULL || addr + size > bank->base + bank->size ||
+        !demu_get_ram_chunks(bank, addr - bank->base, size))
+        return NULL;
+
+    return bank->va + (addr - bank->base);
+}
+
+/* Returns false if ptr is not in guest RAM mapped in advance */
+static bool demu_put_host_addr(void *ptr, uint64_t size)
+{
+    demu_ram_bank_t *bank;
+    uint64_t        offset;
+    unsigned int    i;
+
+    if (size == 0)
+        size = 1;
+
+    /* There are only a handful of banks */
+    for (i = 0; i < demu_state.nr_ram_banks; i++) {
+        bank = &demu_state.ram_bank[i];
+        if (bank->va && ptr >= bank->va && ptr < bank->va + bank->size) {
+            offset = ptr - bank->va;
+            demu_put_ram_chunks(bank, offset >> GUEST_RAM_CHUNK_SHIFT,
+                                (offset + size - 1) >> GUEST_RAM_CHUNK_SHIFT);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void *
 demu_map_guest_range(uint64_t addr, uint64_t size, int prot)
 {
@@ -210,15 +779,28 @@ demu_map_guest_range(uint64_t addr, uint64_t size, int prot)
     unsigned int         i, n;
     void        *ptr;
 
+    /* Guest RAM mapped in advance needs no hypercall at all */
+    if (demu_state.nr_ram_banks && !(addr & XEN_GRANT_ADDR_OFF)) {
+        ptr = demu_get_host_addr(addr, size);
+        if (ptr)
+            return ptr;
+    }
+
     size += addr & ~TARGET_PAGE_MASK;
     size = P2ROUNDUP(size, TARGET_PAGE_SIZE);
     n = size >> TARGET_PAGE_SHIFT;
 
-#ifndef MAP_IN_ADVANCE
     demu_detect_mappings_model(addr);
-#endif
 
-    if (demu_state.use_gnttab > 0) {
+    if (demu_state.use_gnttab > 0 && demu_gntcache()) {
+        BUG_ON(!(addr & XEN_GRANT_ADDR_OFF));
+
+        ptr = mapcache_map(demu_state.gntcache,
+                           (addr & ~XEN_GRANT_ADDR_OFF) >> TARGET_PAGE_SHIFT,
+                           n, prot);
+        if (ptr == NULL)
+            goto fail1;
+    } else if (demu_state.use_gnttab > 0) {
         BUG_ON(!(addr & XEN_GRANT_ADDR_OFF));
 
         grants = malloc(sizeof (uint32_t) * n);
@@ -233,6 +815,14 @@ demu_map_guest_range(uint64_t addr, uint64_t size, int prot)
             goto fail2;
 
         free(grants);
+    } else if (demu_state.mapcache) {
+        BUG_ON(addr & XEN_GRANT_ADDR_OFF);
+
+        /* Always map read-write so that one entry serves both directions */
+        ptr = mapcache_map(demu_state.mapcache, addr >> TARGET_PAGE_SHIFT, n,
+                           PROT_READ | PROT_WRITE);
+        if (ptr == NULL)
+            goto fail1;
     } else {
         BUG_ON(addr & XEN_GRANT_ADDR_OFF);
 
@@ -272,152 +862,217 @@ demu_unmap_guest_range(void *ptr, uint64_t size)
 {
     unsigned int n;
 
+    if (demu_state.nr_ram_banks && demu_put_host_addr(ptr, size))
+        return 0;
+
     size += (unsigned long)ptr & ~TARGET_PAGE_MASK;
     size = P2ROUNDUP(size, TARGET_PAGE_SIZE);
     n = size >> TARGET_PAGE_SHIFT;
+    ptr = (void *)((unsigned long)ptr & TARGET_PAGE_MASK);
 
-    if (demu_state.use_gnttab > 0)
-        demu_unmap_guest_grant_refs((void *)((unsigned long)ptr & TARGET_PAGE_MASK), n);
-    else
-        demu_unmap_guest_pages((void *)((unsigned long)ptr & TARGET_PAGE_MASK), n);
+    if (demu_state.use_gnttab > 0) {
+        if (!demu_state.gntcache || !mapcache_unmap(demu_state.gntcache, ptr))
+            demu_unmap_guest_grant_refs(ptr, n);
+    } else if (!demu_state.mapcache || !mapcache_unmap(demu_state.mapcache, ptr))
+        demu_unmap_guest_pages(ptr, n);
 
     return 0;
 }
 
-#ifdef MAP_IN_ADVANCE
-#define NR_GUEST_RAM 2
-static void *host_addr[NR_GUEST_RAM];
-
-static uint64_t guest_ram_base[NR_GUEST_RAM];
-static uint64_t guest_ram_size[NR_GUEST_RAM];
+/*
+ * Scratch arrays of frames/grants used to map a whole chain at once. They
+ * only ever grow and are private to the thread doing the mapping.
+ */
+static __thread xen_pfn_t   *demu_iov_pfn;
+static __thread uint32_t    *demu_iov_grants;
+static __thread unsigned int demu_iov_frames;
 
-/* TODO Find a proper way to get guest ram bank info */
-static uint64_t xenctrl_get_dom_mem(domid_t domid)
+static int demu_iov_reserve(unsigned int n)
 {
-	xc_dominfo_t dominfo;
-	xc_interface *xch;
+    xen_pfn_t   *pfn;
+    uint32_t    *grants;
 
-	xch = xc_interface_open(NULL, NULL, 0);
-	if (xch == NULL)
-		return 0;
+    if (n <= demu_iov_frames)
+        return 0;
 
-	if ((xc_domain_getinfo(xch, domid, 1, &dominfo) != 1) ||
-			(dominfo.domid != domid)) {
-		DBG("Failed to get domain information\n");
-		xc_interface_close(xch);
-		return 0;
-	}
+    n = roundup_pow_of_two(n);
 
-	xc_interface_close(xch);
+    pfn = realloc(demu_iov_pfn, sizeof (xen_pfn_t) * n);
+    if (pfn == NULL)
+        return -1;
+    demu_iov_pfn = pfn;
 
-	return (dominfo.nr_pages - 4) << TARGET_PAGE_SHIFT;
+    grants = realloc(demu_iov_grants, sizeof (uint32_t) * n);
+    if (grants == NULL)
+        return -1;
+    demu_iov_grants = grants;
+
+    demu_iov_frames = n;
+
+    return 0;
 }
 
-static int demu_init_guest_ram(void)
+static unsigned int demu_iov_nr_frames(struct iovec *iov)
 {
-	uint64_t mem;
-
-	memset(guest_ram_base, 0, sizeof(guest_ram_base));
-	memset(guest_ram_size, 0, sizeof(guest_ram_size));
-
-	mem = xenctrl_get_dom_mem(demu_state.domid);
-	if (mem == 0)
-		return -1;
-
-	/* #define-s below located at include/public/arch-arm.h */
-	guest_ram_base[0] = GUEST_RAM0_BASE;
-	if (mem <= GUEST_RAM0_SIZE)
-		guest_ram_size[0] = mem;
-	else {
-		guest_ram_size[0] = GUEST_RAM0_SIZE;
-		guest_ram_base[1] = GUEST_RAM1_BASE;
-		guest_ram_size[1] = mem - GUEST_RAM0_SIZE;
-	}
-
-	return 0;
+    uint64_t addr = (uint64_t)(unsigned long)iov->iov_base;
+    uint64_t size = iov->iov_len + (addr & ~TARGET_PAGE_MASK);
+
+    return P2ROUNDUP(size, TARGET_PAGE_SIZE) >> TARGET_PAGE_SHIFT;
 }
 
-static int demu_map_guest_ram(void)
+/* Map segments [first, first + count) into one window */
+static void *demu_map_guest_iov_window(struct iovec iov[], unsigned int first,
+                                       unsigned int count, int prot,
+                                       unsigned int *nr)
 {
-	unsigned int i;
+    unsigned int    i, j, n = 0;
+    void            *ptr;
+
+    for (i = first; i < first + count; i++)
+        n += demu_iov_nr_frames(&iov[i]);
 
-	for (i = 0; i < NR_GUEST_RAM; i++) {
-		if (host_addr[i])
-			continue;
+    if (demu_iov_reserve(n) < 0)
+        return NULL;
+
+    n = 0;
+    for (i = first; i < first + count; i++) {
+        uint64_t addr = (uint64_t)(unsigned long)iov[i].iov_base;
+        unsigned int frames = demu_iov_nr_frames(&iov[i]);
+
+        addr &= ~XEN_GRANT_ADDR_OFF;
+        for (j = 0; j < frames; j++) {
+            demu_iov_pfn[n + j] = (addr >> TARGET_PAGE_SHIFT) + j;
+            demu_iov_grants[n + j] = (addr >> TARGET_PAGE_SHIFT) + j;
+        }
+        n += frames;
+    }
 
-		if (!guest_ram_base[i] || !guest_ram_size[i])
-			continue;
+    if (demu_state.use_gnttab > 0)
+        ptr = demu_map_guest_grant_refs(demu_iov_grants, n, prot);
+    else
+        ptr = demu_map_guest_pages(demu_iov_pfn, n, prot);
+    if (ptr == NULL)
+        return NULL;
 
-		host_addr[i] = demu_map_guest_range(guest_ram_base[i], guest_ram_size[i],
-				PROT_READ | PROT_WRITE);
+    *nr = n;
+    return ptr;
+}
 
-		if (!host_addr[i]) {
-			DBG("Cannot map guest ram%u pa 0x%lx-0x%lx\n",
-					i, guest_ram_base[i], guest_ram_base[i] + guest_ram_size[i]);
-			goto fail;
-		}
+/* Point segments [first, first + count) into the window mapped at ptr */
+static void demu_rebase_guest_iov(struct iovec iov[], unsigned int first,
+                                  unsigned int count, void *ptr)
+{
+    unsigned int    i, n = 0;
 
-		DBG("Mapped guest ram%u pa 0x%lx-0x%lx to va 0x%lx\n",
-				i, guest_ram_base[i], guest_ram_base[i] + guest_ram_size[i],
-				(unsigned long)host_addr[i]);
-	}
+    for (i = first; i < first + count; i++) {
+        uint64_t addr = (uint64_t)(unsigned long)iov[i].iov_base;
+        unsigned int frames = demu_iov_nr_frames(&iov[i]);
 
-	return 0;
+        iov[i].iov_base = ptr + ((size_t)n << TARGET_PAGE_SHIFT) +
+                          (addr & ~TARGET_PAGE_MASK);
+        n += frames;
+    }
+}
 
-fail:
-	while (i--) {
-		if (host_addr[i]) {
-			demu_unmap_guest_range(host_addr[i], guest_ram_size[i]);
-			host_addr[i] = NULL;
-		}
-	}
-
-	return -1;
+static void demu_unmap_guest_iov_window(void *ptr, unsigned int n)
+{
+    if (demu_state.use_gnttab > 0)
+        demu_unmap_guest_grant_refs(ptr, n);
+    else
+        demu_unmap_guest_pages(ptr, n);
 }
 
-static void demu_unmap_guest_ram(void)
+int
+demu_map_guest_iov(struct demu_iov_mapping *map, struct iovec iov[],
+                   unsigned int out, unsigned int in)
 {
-	unsigned int i;
+    unsigned int    i;
+
+    memset(map, 0, sizeof (*map));
+
+    if (out + in == 0)
+        return 0;
+
+    demu_detect_mappings_model((uint64_t)(unsigned long)iov[0].iov_base);
+
+    /*
+     * Translating pre-mapped guest RAM, or cached mappings, is cheaper
+     * than any batch.
+     */
+    if (demu_state.nr_ram_banks ||
+        ((demu_state.use_gnttab > 0) ? demu_gntcache() != NULL :
+                                       demu_state.mapcache != NULL))
+        goto slow;
+
+    if (demu_state.use_gnttab > 0) {
+        if (out) {
+            map->va[0] = demu_map_guest_iov_window(iov, 0, out, PROT_READ,
+                                                   &map->n[0]);
+            if (map->va[0] == NULL)
+                goto slow;
+        }
+
+        if (in) {
+            map->va[1] = demu_map_guest_iov_window(iov, out, in,
+                                                   PROT_READ | PROT_WRITE,
+                                                   &map->n[1]);
+            if (map->va[1] == NULL) {
+                if (map->va[0])
+                    demu_unmap_guest_iov_window(map->va[0], map->n[0]);
+                memset(map, 0, sizeof (*map));
+                goto slow;
+            }
+        }
+
+        if (out)
+            demu_rebase_guest_iov(iov, 0, out, map->va[0]);
+        if (in)
+            demu_rebase_guest_iov(iov, out, in, map->va[1]);
+    } else {
+        map->va[0] = demu_map_guest_iov_window(iov, 0, out + in,
+                                               PROT_READ | PROT_WRITE,
+                                               &map->n[0]);
+        if (map->va[0] == NULL)
+            goto slow;
 
-	for (i = 0; i < NR_GUEST_RAM; i++) {
-		if (!host_addr[i])
-			continue;
+        demu_rebase_guest_iov(iov, 0, out + in, map->va[0]);
+    }
+
+    map->batched = true;
+    return 0;
 
-		demu_unmap_guest_range(host_addr[i], guest_ram_size[i]);
-		DBG("Unmapped guest ram%u va 0x%lx\n", i, (unsigned long)host_addr[i]);
-		host_addr[i] = NULL;
-	}
+slow:
+    for (i = 0; i < out + in; i++) {
+        iov[i].iov_base = demu_map_guest_range(
+                (uint64_t)(unsigned long)iov[i].iov_base, iov[i].iov_len,
+                i < out ? PROT_READ : PROT_WRITE);
+        if (iov[i].iov_base == NULL) {
+            demu_unmap_guest_iov(map, iov, i);
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
-void *demu_get_host_addr(uint64_t offset)
+void
+demu_unmap_guest_iov(struct demu_iov_mapping *map, struct iovec iov[],
+                     unsigned int n)
 {
-	void *addr;
-	unsigned int i;
-
-	if (offset & XEN_GRANT_ADDR_OFF) {
-		DBG("The highest bit is set in guest pa 0x%lx (MAP_IN_ADVANCE option must be disabled)\n",
-				offset);
-		BUG_ON(1);
-	}
-
-	for (i = 0; i < NR_GUEST_RAM; i++) {
-		if (!host_addr[i])
-			continue;
-
-		if (offset >= guest_ram_base[i] &&
-				offset < guest_ram_base[i] + guest_ram_size[i]) {
-			addr = host_addr[i] + (offset - guest_ram_base[i]);
-			/*DBG("Translate guest pa 0x%lx to host va 0x%lx\n",
-					offset, (unsigned long)addr);*/
-			return addr;
-		}
-	}
-
-	DBG("Cannot translate guest pa 0x%lx\n", offset);
-
-	return NULL;
+    unsigned int    i;
+
+    if (map->batched) {
+        for (i = 0; i < ARRAY_SIZE(map->va); i++) {
+            if (map->va[i])
+                demu_unmap_guest_iov_window(map->va[i], map->n[i]);
+        }
+        memset(map, 0, sizeof (*map));
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        demu_unmap_guest_range(iov[i].iov_base, iov[i].iov_len);
 }
-#endif
 
 static demu_space_t *
 demu_find_space(demu_space_t *head, uint64_t addr)
@@ -585,10 +1240,7 @@ demu_handle_ioreq(ioreq_t *ioreq)
         break;
 
     case IOREQ_TYPE_INVALIDATE:
-#ifdef MAP_IN_ADVANCE
-        /* TODO Remap the whole guest ram once it's memory layout is changed */
-        DBG("NOT IMPLEMENTED (%02x)\n", ioreq->type);
-#endif
+        demu_invalidate_guest_mappings();
         break;
 
     default:
@@ -606,84 +1258,291 @@ demu_seq_next(void)
     case DEMU_SEQ_XENSTORE_ATTACHED: {
         int i;
 
-        DBG(">XENSTORE_ATTACHED\n");
-        DBG("domid = %u\n", demu_state.domid);
-        DBG("devid = %u\n", demu_state.xs_dev->devid);
+        DBG(">XENSTORE_ATTACHED\n");
+        DBG("domid = %u\n", demu_state.domid);
+        DBG("devid = %u\n", demu_state.xs_dev->devid);
+
+        for (i = 0; i < image_count; i++) {
+            DBG("filename[%d] = %s\n", i, disk_image[i].filename);
+            DBG("readonly[%d] = %d\n", i, disk_image[i].readonly);
+            DBG("base[%d]     = 0x%x\n", i, disk_image[i].addr);
+            DBG("irq[%d]      = %u\n", i, disk_image[i].irq);
+        }
+        break;
+    }
+
+    case DEMU_SEQ_XENEVTCHN_OPEN:
+        DBG(">XENEVTCHN_OPEN\n");
+        break;
+
+    case DEMU_SEQ_XENFOREIGNMEMORY_OPEN:
+        DBG(">XENFOREIGNMEMORY_OPEN\n");
+        break;
+
+    case DEMU_SEQ_XENDEVICEMODEL_OPEN:
+        DBG(">XENDEVICEMODEL_OPEN\n");
+        break;
+
+    case DEMU_SEQ_XENGNTTAB_OPEN:
+        DBG(">XENGNTTAB_OPEN\n");
+        break;
+
+    case DEMU_SEQ_MAPCACHE_CREATED:
+        DBG(">MAPCACHE_CREATED\n");
+        DBG("mapcache = %p\n", demu_state.mapcache);
+        DBG("gntcache = %p\n", demu_state.gntcache);
+        break;
+
+    case DEMU_SEQ_SERVER_REGISTERED:
+        DBG(">SERVER_REGISTERED\n");
+        DBG("ioservid = %u\n", demu_state.ioservid);
+        break;
+
+    case DEMU_SEQ_RESOURCE_MAPPED:
+        DBG(">RESOURCE_MAPPED\n");
+        DBG("shared_iopage = %p\n", demu_state.shared_iopage);
+        DBG("buffered_iopage = %p\n", demu_state.buffered_iopage);
+        break;
+
+    case DEMU_SEQ_SERVER_ENABLED:
+        DBG(">SERVER_ENABLED\n");
+        break;
+
+    case DEMU_SEQ_PORT_ARRAY_ALLOCATED:
+        DBG(">PORT_ARRAY_ALLOCATED\n");
+        break;
+
+    case DEMU_SEQ_PORTS_BOUND: {
+        int i;
+
+        DBG(">EVTCHN_PORTS_BOUND\n");
+
+        for (i = 0; i < demu_state.vcpus; i++)
+            DBG("VCPU%d: %u -> %u\n", i,
+                demu_state.shared_iopage->vcpu_ioreq[i].vp_eport,
+                demu_state.ioreq_local_port[i]);
+
+        if (demu_state.buffered_iopage)
+            DBG("BUF: %u -> %u\n", demu_state.bufioreq_port,
+                demu_state.bufioreq_local_port);
+
+        break;
+    }
+
+    case DEMU_SEQ_GUEST_RAM_MAPPED:
+        DBG(">GUEST_RAM_MAPPED\n");
+        break;
+
+    case DEMU_SEQ_DEVICE_INITIALIZED:
+        DBG(">DEVICE_INITIALIZED\n");
+        break;
+
+    case DEMU_SEQ_VCPU_THREADS_STARTED:
+        DBG(">VCPU_THREADS_STARTED\n");
+        break;
+
+    case DEMU_SEQ_INITIALIZED:
+        DBG(">INITIALIZED\n");
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+/*
+ * Buffered ioreqs are writes Xen did not wait for, there is nothing to
+ * respond to. They may be consumed from several threads, so the read
+ * pointer is only advanced under the lock.
+ */
+static void
+demu_poll_buffered_iopage(void)
+{
+    static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+    buffered_iopage_t       *page = demu_state.buffered_iopage;
+    buf_ioreq_t             *buf_ioreq;
+    ioreq_t                 ioreq;
+    uint32_t                rdptr, wrptr;
+    unsigned int            n;
+
+    if (page == NULL)
+        return;
+
+    pthread_mutex_lock(&lock);
+
+    for (;;) {
+        rdptr = page->read_pointer;
+        wrptr = page->write_pointer;
+        xen_rmb();
+
+        if (rdptr == wrptr)
+            break;
+
+        buf_ioreq = &page->buf_ioreq[rdptr % IOREQ_BUFFER_SLOT_NUM];
+
+        memset(&ioreq, 0, sizeof (ioreq));
+        ioreq.addr = buf_ioreq->addr;
+        ioreq.data = buf_ioreq->data;
+        ioreq.size = 1u << buf_ioreq->size;
+        ioreq.count = 1;
+        ioreq.dir = buf_ioreq->dir;
+        ioreq.type = buf_ioreq->type;
+        ioreq.state = STATE_IOREQ_READY;
+        n = 1;
+
+        /* Quad words take two slots, Xen publishes both at once */
+        if (ioreq.size == 8) {
+            if (rdptr + 1 == wrptr) {
+                DBG("Incomplete quad word buffered ioreq\n");
+                break;
+            }
+
+            buf_ioreq = &page->buf_ioreq[(rdptr + 1) % IOREQ_BUFFER_SLOT_NUM];
+            ioreq.data |= (uint64_t)buf_ioreq->data << 32;
+            n = 2;
+        }
+        xen_rmb();
+
+        demu_handle_ioreq(&ioreq);
+
+        __sync_fetch_and_add(&page->read_pointer, n);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+demu_poll_shared_iopage(unsigned int i)
+{
+    ioreq_t *ioreq;
+
+    /* Writes buffered before this request must be seen first */
+    demu_poll_buffered_iopage();
+
+    ioreq = &demu_state.shared_iopage->vcpu_ioreq[i];
+    if (ioreq->state != STATE_IOREQ_READY) {
+        fprintf(stderr, "IO request not ready\n");
+        return;
+    }
+
+    xen_mb();
+
+    ioreq->state = STATE_IOREQ_INPROCESS;
+
+    demu_handle_ioreq(ioreq);
+    xen_mb();
+
+    ioreq->state = STATE_IORESP_READY;
+    xen_mb();
+
+    xenevtchn_notify(demu_vcpu_xeh(i), demu_state.ioreq_local_port[i]);
+}
+
+static void *
+demu_vcpu_thread(void *arg)
+{
+    unsigned int                i = (unsigned long)arg;
+    xenevtchn_handle            *xeh = demu_state.vcpu_xeh[i];
+    xenevtchn_port_or_error_t   port;
+    struct pollfd               pfd[2] = {
+        { .fd = xenevtchn_fd(xeh), .events = POLLIN },
+        { .fd = demu_state.vcpu_stop_fd, .events = POLLIN },
+    };
+    char                        name[16];
+
+    snprintf(name, sizeof (name), "demu-vcpu%u", i);
+    kvm__set_thread_name(name);
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfd[1].revents)
+            break;
+
+        while ((port = xenevtchn_pending(xeh)) >= 0) {
+            xenevtchn_unmask(xeh, port);
+            demu_poll_shared_iopage(i);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+demu_start_vcpu_threads(void)
+{
+    sigset_t        block, old;
+    unsigned int    i;
+
+    demu_state.vcpu_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (demu_state.vcpu_stop_fd < 0)
+        goto fail1;
+
+    demu_state.vcpu_thread = calloc(demu_state.vcpus, sizeof (pthread_t));
+    if (demu_state.vcpu_thread == NULL)
+        goto fail2;
 
-        for (i = 0; i < image_count; i++) {
-            DBG("filename[%d] = %s\n", i, disk_image[i].filename);
-            DBG("readonly[%d] = %d\n", i, disk_image[i].readonly);
-            DBG("base[%d]     = 0x%x\n", i, disk_image[i].addr);
-            DBG("irq[%d]      = %u\n", i, disk_image[i].irq);
-        }
-        break;
+    /* Termination signals must be taken by the main thread */
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for (i = 0; i < demu_state.vcpus; i++) {
+        if (pthread_create(&demu_state.vcpu_thread[i], NULL,
+                           demu_vcpu_thread, (void *)(unsigned long)i))
+            goto fail3;
     }
 
-    case DEMU_SEQ_XENEVTCHN_OPEN:
-        DBG(">XENEVTCHN_OPEN\n");
-        break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    case DEMU_SEQ_XENFOREIGNMEMORY_OPEN:
-        DBG(">XENFOREIGNMEMORY_OPEN\n");
-        break;
+    return 0;
 
-    case DEMU_SEQ_XENDEVICEMODEL_OPEN:
-        DBG(">XENDEVICEMODEL_OPEN\n");
-        break;
+fail3:
+    DBG("fail3\n");
 
-    case DEMU_SEQ_XENGNTTAB_OPEN:
-        DBG(">XENGNTTAB_OPEN\n");
-        break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    case DEMU_SEQ_SERVER_REGISTERED:
-        DBG(">SERVER_REGISTERED\n");
-        DBG("ioservid = %u\n", demu_state.ioservid);
-        break;
+    /* Let the threads that did start go */
+    eventfd_write(demu_state.vcpu_stop_fd, 1);
+    while (i-- > 0)
+        pthread_join(demu_state.vcpu_thread[i], NULL);
 
-    case DEMU_SEQ_RESOURCE_MAPPED:
-        DBG(">RESOURCE_MAPPED\n");
-        DBG("shared_iopage = %p\n", demu_state.shared_iopage);
-        break;
+    free(demu_state.vcpu_thread);
+    demu_state.vcpu_thread = NULL;
 
-    case DEMU_SEQ_SERVER_ENABLED:
-        DBG(">SERVER_ENABLED\n");
-        break;
+fail2:
+    DBG("fail2\n");
 
-    case DEMU_SEQ_PORT_ARRAY_ALLOCATED:
-        DBG(">PORT_ARRAY_ALLOCATED\n");
-        break;
+    close(demu_state.vcpu_stop_fd);
 
-    case DEMU_SEQ_PORTS_BOUND: {
-        int i;
+fail1:
+    DBG("fail1\n");
 
-        DBG(">EVTCHN_PORTS_BOUND\n");
+    warn("fail");
+    return -1;
+}
 
-        for (i = 0; i < demu_state.vcpus; i++)
-            DBG("VCPU%d: %u -> %u\n", i,
-                demu_state.shared_iopage->vcpu_ioreq[i].vp_eport,
-                demu_state.ioreq_local_port[i]);
+static void
+demu_stop_vcpu_threads(void)
+{
+    unsigned int    i;
 
-        break;
-    }
+    if (demu_state.vcpu_thread == NULL)
+        return;
 
-#ifdef MAP_IN_ADVANCE
-    case DEMU_SEQ_GUEST_RAM_MAPPED:
-        DBG(">GUEST_RAM_MAPPED\n");
-        break;
-#endif
+    eventfd_write(demu_state.vcpu_stop_fd, 1);
 
-    case DEMU_SEQ_DEVICE_INITIALIZED:
-        DBG(">DEVICE_INITIALIZED\n");
-        break;
+    for (i = 0; i < demu_state.vcpus; i++)
+        pthread_join(demu_state.vcpu_thread[i], NULL);
 
-    case DEMU_SEQ_INITIALIZED:
-        DBG(">INITIALIZED\n");
-        break;
+    free(demu_state.vcpu_thread);
+    demu_state.vcpu_thread = NULL;
 
-    default:
-        assert(0);
-        break;
-    }
+    close(demu_state.vcpu_stop_fd);
 }
 
 static void
@@ -692,6 +1551,14 @@ demu_teardown(void)
     if (demu_state.seq == DEMU_SEQ_INITIALIZED) {
         DBG("<INITIALIZED\n");
 
+        demu_state.seq = DEMU_SEQ_VCPU_THREADS_STARTED;
+    }
+
+    if (demu_state.seq == DEMU_SEQ_VCPU_THREADS_STARTED) {
+        DBG("<VCPU_THREADS_STARTED\n");
+
+        demu_stop_vcpu_threads();
+
         demu_state.seq = DEMU_SEQ_DEVICE_INITIALIZED;
     }
 
@@ -699,7 +1566,6 @@ demu_teardown(void)
         DBG("<DEVICE_INITIALIZED\n");
         device_teardown();
 
-#ifdef MAP_IN_ADVANCE
         demu_state.seq = DEMU_SEQ_GUEST_RAM_MAPPED;
     }
 
@@ -710,14 +1576,14 @@ demu_teardown(void)
 
         demu_state.seq = DEMU_SEQ_PORTS_BOUND;
     }
-#else
-        demu_state.seq = DEMU_SEQ_PORTS_BOUND;
-    }
-#endif
 
     if (demu_state.seq >= DEMU_SEQ_PORTS_BOUND) {
         DBG("<EVTCHN_PORTS_BOUND\n");
 
+        free(demu_state.port_vcpu);
+        demu_state.port_vcpu = NULL;
+        demu_state.nr_port_vcpu = 0;
+
         demu_state.seq = DEMU_SEQ_PORT_ARRAY_ALLOCATED;
     }
 
@@ -733,12 +1599,25 @@ demu_teardown(void)
 
             if (port >= 0) {
                 DBG("VCPU%d: %u\n", i, port);
-                (void) xenevtchn_unbind(demu_state.xeh, port);
+                (void) xenevtchn_unbind(demu_vcpu_xeh(i), port);
             }
+
+            if (demu_state.vcpu_xeh && demu_state.vcpu_xeh[i])
+                xenevtchn_close(demu_state.vcpu_xeh[i]);
         }
 
+        free(demu_state.vcpu_xeh);
+        demu_state.vcpu_xeh = NULL;
+
         free(demu_state.ioreq_local_port);
 
+        if (demu_state.bufioreq_local_port >= 0) {
+            DBG("BUF: %u\n", demu_state.bufioreq_local_port);
+            (void) xenevtchn_unbind(demu_state.xeh,
+                                    demu_state.bufioreq_local_port);
+            demu_state.bufioreq_local_port = -1;
+        }
+
         demu_state.seq = DEMU_SEQ_SERVER_ENABLED;
     }
 
@@ -757,6 +1636,8 @@ demu_teardown(void)
 
         xenforeignmemory_unmap_resource(demu_state.xfh,
                                         demu_state.resource);
+        demu_state.shared_iopage = NULL;
+        demu_state.buffered_iopage = NULL;
 
         demu_state.seq = DEMU_SEQ_SERVER_REGISTERED;
     }
@@ -767,6 +1648,15 @@ demu_teardown(void)
         (void) xendevicemodel_destroy_ioreq_server(demu_state.xdh,
                                                    demu_state.domid,
                                                    demu_state.ioservid);
+        demu_state.seq = DEMU_SEQ_MAPCACHE_CREATED;
+    }
+
+    if (demu_state.seq >= DEMU_SEQ_MAPCACHE_CREATED) {
+        DBG("<MAPCACHE_CREATED\n");
+
+        demu_destroy_mapcache(&demu_state.mapcache);
+        demu_destroy_mapcache(&demu_state.gntcache);
+
         demu_state.seq = DEMU_SEQ_XENGNTTAB_OPEN;
     }
 
@@ -833,6 +1723,43 @@ demu_sigterm(int num)
     exit(0);
 }
 
+/* Parse a CPU list such as "0-3,8,10-11" */
+static int demu_parse_cpus(const char *str, cpu_set_t *set)
+{
+    unsigned long   first, last;
+    char            *end;
+
+    CPU_ZERO(set);
+
+    while (*str) {
+        first = last = strtoul(str, &end, 10);
+        if (end == str)
+            return -1;
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoul(str, &end, 10);
+            if (end == str || last < first)
+                return -1;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -1;
+
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+
+        str = end;
+    }
+
+    return 0;
+}
+
 static int demu_read_xenstore_config(void *unused)
 {
     char *str;
@@ -861,6 +1788,79 @@ static int demu_read_xenstore_config(void *unused)
         return -1;
     disk_image[image_count].filename = str;
 
+    /* Optional, number of virtqueues and the CPUs serving them */
+    disk_image[image_count].num_queues = 1;
+    if (xenstore_read_be_int(demu_state.xs_dev, "num-queues", &val) == 0 &&
+        val > 0)
+        disk_image[image_count].num_queues = val;
+
+    CPU_ZERO(&disk_image[image_count].cpus);
+    str = xenstore_read_be_str(demu_state.xs_dev, "cpus");
+    if (str) {
+        if (demu_parse_cpus(str, &disk_image[image_count].cpus) < 0) {
+            DBG("Ignoring invalid cpus '%s'\n", str);
+            CPU_ZERO(&disk_image[image_count].cpus);
+        }
+        free(str);
+    }
+
+    /* Optional, asynchronous I/O engine and its polling modes */
+    disk_image[image_count].io_engine =
+        xenstore_read_be_str(demu_state.xs_dev, "io-engine");
+    disk_image[image_count].io_flags = 0;
+    if (xenstore_read_be_int(demu_state.xs_dev, "io-sqpoll", &val) == 0 &&
+        val)
+        disk_image[image_count].io_flags |= DISK_IO_SQPOLL;
+    if (xenstore_read_be_int(demu_state.xs_dev, "io-iopoll", &val) == 0 &&
+        val)
+        disk_image[image_count].io_flags |= DISK_IO_IOPOLL;
+    if (xenstore_read_be_int(demu_state.xs_dev, "io-threads", &val) == 0 &&
+        val > 0)
+        disk_image[image_count].io_threads = val;
+
+    /* Optional, interrupt coalescing */
+    if (xenstore_read_be_int(demu_state.xs_dev, "irq-coalesce-count",
+                             &val) == 0 && val > 0)
+        disk_image[image_count].irq_coalesce_count = val;
+    if (xenstore_read_be_int(demu_state.xs_dev, "irq-coalesce-usecs",
+                             &val) == 0 && val > 0)
+        disk_image[image_count].irq_coalesce_usecs = val;
+
+    /* Optional, adaptive virtqueue polling */
+    if (xenstore_read_be_int(demu_state.xs_dev, "poll-usecs", &val) == 0 &&
+        val > 0)
+        disk_image[image_count].poll_usecs = val;
+
+    /* Optional, host cache mode: writeback (default), writethrough, unsafe */
+    disk_image[image_count].cache_mode = DISK_CACHE_WRITEBACK;
+    str = xenstore_read_be_str(demu_state.xs_dev, "cache");
+    if (str) {
+        if (strcmp(str, "writethrough") == 0)
+            disk_image[image_count].cache_mode = DISK_CACHE_WRITETHROUGH;
+        else if (strcmp(str, "unsafe") == 0)
+            disk_image[image_count].cache_mode = DISK_CACHE_UNSAFE;
+        else if (strcmp(str, "writeback") != 0)
+            DBG("Ignoring invalid cache mode '%s'\n", str);
+        free(str);
+    }
+
+    /* Optional, read ahead of sequential streams into up to this many KiB */
+    if (xenstore_read_be_int(demu_state.xs_dev, "readahead-kb", &val) == 0 &&
+        val > 0)
+        disk_image[image_count].readahead_kb = val;
+
+    /* Optional, bypass the host page cache */
+    if (xenstore_read_be_int(demu_state.xs_dev, "direct-io", &val) == 0)
+        disk_image[image_count].direct = !!val;
+
+    /* Frontends opt in as they start the device, see demu_frontend_started() */
+    if (demu_state.gntcache_size)
+        xenstore_write_be_int(demu_state.xs_dev, "feature-persistent", 1);
+
+    /* Optional, map the whole guest RAM up front instead of per request */
+    if (xenstore_read_be_int(demu_state.xs_dev, "map-in-advance", &val) == 0)
+        demu_state.map_in_advance = val;
+
     image_count ++;
 
     return ret;
@@ -870,6 +1870,7 @@ static int
 demu_initialize(void)
 {
     int             rc;
+    int             bufioreq;
     void            *addr;
     evtchn_port_t   port;
     int             i;
@@ -881,7 +1882,7 @@ demu_initialize(void)
 
     demu_seq_next();
 
-    demu_state.xeh = xenevtchn_open(NULL, 0);
+    demu_state.xeh = demu_open_xenevtchn();
     if (demu_state.xeh == NULL)
         goto fail1;
 
@@ -906,30 +1907,86 @@ demu_initialize(void)
 
     demu_seq_next();
 
+    if (demu_state.mapcache_size) {
+        demu_state.mapcache = mapcache_create("foreign",
+                                              demu_state.mapcache_size,
+                                              MAPCACHE_BUCKET_SHIFT,
+                                              &demu_mapcache_ops, NULL);
+        if (demu_state.mapcache == NULL)
+            goto fail5;
+    }
+
+    if (demu_state.gntcache_size) {
+        uint32_t nr_grants = demu_state.gntcache_size >> TARGET_PAGE_SHIFT;
+
+        /* Leave room for the mappings which do not fit the cache */
+        if (xengnttab_set_max_grants(demu_state.xgt, nr_grants * 2) < 0)
+            DBG("Failed to raise grant mapping limit to %u\n", nr_grants * 2);
+
+        demu_state.gntcache = mapcache_create("grant",
+                                              demu_state.gntcache_size,
+                                              0, &demu_gntcache_ops, NULL);
+        if (demu_state.gntcache == NULL) {
+            demu_destroy_mapcache(&demu_state.mapcache);
+            goto fail5;
+        }
+    }
+
+    demu_seq_next();
+
     rc = xendevicemodel_nr_vcpus(demu_state.xdh, demu_state.domid, &demu_state.vcpus);
     if (rc < 0)
-        goto fail5;
+        goto fail6;
 
     DBG("%d vCPU(s)\n", demu_state.vcpus);
 
+    /* Fall back to synchronous ioreqs only if Xen can't do better */
+    bufioreq = HVM_IOREQSRV_BUFIOREQ_ATOMIC;
     rc = xendevicemodel_create_ioreq_server(demu_state.xdh,
-                                            demu_state.domid, HVM_IOREQSRV_BUFIOREQ_OFF,
+                                            demu_state.domid, bufioreq,
                                             &demu_state.ioservid);
+    if (rc < 0) {
+        DBG("No buffered ioreqs\n");
+
+        bufioreq = HVM_IOREQSRV_BUFIOREQ_OFF;
+        rc = xendevicemodel_create_ioreq_server(demu_state.xdh,
+                                                demu_state.domid, bufioreq,
+                                                &demu_state.ioservid);
+    }
     if (rc < 0)
-        goto fail6;
-    
+        goto fail7;
+
     demu_seq_next();
 
+    if (bufioreq != HVM_IOREQSRV_BUFIOREQ_OFF) {
+        rc = xendevicemodel_get_ioreq_server_info(demu_state.xdh,
+                                                  demu_state.domid,
+                                                  demu_state.ioservid,
+                                                  NULL, NULL,
+                                                  &demu_state.bufioreq_port);
+        if (rc < 0)
+            goto fail8;
+    }
+
+    /* The buffered ioreq frame, if any, precedes the synchronous one */
     addr = NULL;
     demu_state.resource =
         xenforeignmemory_map_resource(demu_state.xfh, demu_state.domid,
                                       XENMEM_resource_ioreq_server,
                                       demu_state.ioservid,
-                                      XENMEM_resource_ioreq_server_frame_ioreq(0), 1,
+                                      bufioreq != HVM_IOREQSRV_BUFIOREQ_OFF ?
+                                      XENMEM_resource_ioreq_server_frame_bufioreq :
+                                      XENMEM_resource_ioreq_server_frame_ioreq(0),
+                                      bufioreq != HVM_IOREQSRV_BUFIOREQ_OFF ? 2 : 1,
                                       &addr,
                                       PROT_READ | PROT_WRITE, 0);
     if (demu_state.resource == NULL)
-        goto fail7;
+        goto fail8;
+
+    if (bufioreq != HVM_IOREQSRV_BUFIOREQ_OFF) {
+        demu_state.buffered_iopage = addr;
+        addr += TARGET_PAGE_SIZE;
+    }
 
     demu_state.shared_iopage = addr;
 
@@ -940,48 +1997,99 @@ demu_initialize(void)
                                                demu_state.ioservid,
                                                1);
     if (rc != 0)
-        goto fail8;
+        goto fail9;
 
     demu_seq_next();
 
     demu_state.ioreq_local_port = malloc(sizeof (evtchn_port_t) *
                                          demu_state.vcpus);
     if (demu_state.ioreq_local_port == NULL)
-        goto fail9;
+        goto fail10;
 
     for (i = 0; i < demu_state.vcpus; i++)
         demu_state.ioreq_local_port[i] = -1;
 
+    demu_state.bufioreq_local_port = -1;
+
+    if (demu_state.vcpu_threads) {
+        demu_state.vcpu_xeh = calloc(demu_state.vcpus,
+                                     sizeof (xenevtchn_handle *));
+        if (demu_state.vcpu_xeh == NULL) {
+            free(demu_state.ioreq_local_port);
+            goto fail10;
+        }
+    }
+
     demu_seq_next();
 
     for (i = 0; i < demu_state.vcpus; i++) {
         port = demu_state.shared_iopage->vcpu_ioreq[i].vp_eport;
 
-        rc = xenevtchn_bind_interdomain(demu_state.xeh, demu_state.domid,
+        /* Each service thread waits on a handle of its own */
+        if (demu_state.vcpu_threads) {
+            demu_state.vcpu_xeh[i] = demu_open_xenevtchn();
+            if (demu_state.vcpu_xeh[i] == NULL)
+                goto fail11;
+        }
+
+        rc = xenevtchn_bind_interdomain(demu_vcpu_xeh(i), demu_state.domid,
                                         port);
         if (rc < 0)
-            goto fail10;
+            goto fail11;
 
         demu_state.ioreq_local_port[i] = rc;
     }
 
-    demu_seq_next();
+    /* Buffered ioreqs are drained by the main loop */
+    if (demu_state.buffered_iopage) {
+        rc = xenevtchn_bind_interdomain(demu_state.xeh, demu_state.domid,
+                                        demu_state.bufioreq_port);
+        if (rc < 0)
+            goto fail11;
 
-#ifdef MAP_IN_ADVANCE
-    rc = demu_init_guest_ram();
-    if (rc < 0)
-        goto fail11;
+        demu_state.bufioreq_local_port = rc;
+    }
 
-    rc = demu_map_guest_ram();
-    if (rc < 0)
+    /* Local ports are small integers, index them directly */
+    for (i = 0; i < demu_state.vcpus; i++)
+        demu_state.nr_port_vcpu = __max(demu_state.nr_port_vcpu,
+                                        demu_state.ioreq_local_port[i] + 1);
+
+    demu_state.port_vcpu = malloc(sizeof (int) * demu_state.nr_port_vcpu);
+    if (demu_state.port_vcpu == NULL)
         goto fail11;
 
+    for (i = 0; i < demu_state.nr_port_vcpu; i++)
+        demu_state.port_vcpu[i] = -1;
+
+    for (i = 0; i < demu_state.vcpus; i++)
+        demu_state.port_vcpu[demu_state.ioreq_local_port[i]] = i;
+
+    demu_seq_next();
+
+    if (demu_state.map_in_advance) {
+        rc = demu_map_guest_ram();
+        if (rc < 0)
+            goto fail12;
+    }
+
     demu_seq_next();
-#endif
 
     rc = device_initialize(disk_image, image_count);
     if (rc < 0)
-        goto fail12;
+        goto fail13;
+
+    demu_seq_next();
+
+    /*
+     * The device is up: the threads serve requests as soon as they run,
+     * an event they consumed would never be delivered again.
+     */
+    if (demu_state.vcpu_threads) {
+        rc = demu_start_vcpu_threads();
+        if (rc < 0)
+            goto fail14;
+    }
 
     demu_seq_next();
 
@@ -990,13 +2098,17 @@ demu_initialize(void)
     assert(demu_state.seq == DEMU_SEQ_INITIALIZED);
     return 0;
 
+fail14:
+    DBG("fail14\n");
+
+fail13:
+    DBG("fail13\n");
+
 fail12:
     DBG("fail12\n");
 
-#ifdef MAP_IN_ADVANCE
 fail11:
     DBG("fail11\n");
-#endif
 
 fail10:
     DBG("fail10\n");
@@ -1035,51 +2147,90 @@ fail0:
     return -1;
 }
 
-static void
-demu_poll_shared_iopage(unsigned int i)
+static int
+demu_poll_iopages(void *unused)
 {
-    ioreq_t *ioreq;
+    xenevtchn_port_or_error_t   port;
 
     if (demu_state.seq != DEMU_SEQ_INITIALIZED)
-        return;
+        return 0;
 
-    ioreq = &demu_state.shared_iopage->vcpu_ioreq[i];
-    if (ioreq->state != STATE_IOREQ_READY) {
-        fprintf(stderr, "IO request not ready\n");
-        return;
-    }
-
-    xen_mb();
+    /* The fd is non-blocking, drain every port that fired */
+    while ((port = xenevtchn_pending(demu_state.xeh)) >= 0) {
+        xenevtchn_unmask(demu_state.xeh, port);
 
-    ioreq->state = STATE_IOREQ_INPROCESS;
+        if (port == demu_state.bufioreq_local_port)
+            demu_poll_buffered_iopage();
+        else if (port < demu_state.nr_port_vcpu &&
+            demu_state.port_vcpu[port] >= 0)
+            demu_poll_shared_iopage(demu_state.port_vcpu[port]);
+    }
 
-    demu_handle_ioreq(ioreq);
-    xen_mb();
+    return 0;
+}
 
-    ioreq->state = STATE_IORESP_READY;
-    xen_mb();
+static int
+demu_poll_xenstore(void *unused)
+{
+    if (xenstore_poll_watches(demu_state.xs_dev) < 0) {
+        DBG("lost connection to dom%d\n", demu_state.domid);
+        return -1;
+    }
 
-    xenevtchn_notify(demu_state.xeh, demu_state.ioreq_local_port[i]);
+    return 0;
 }
 
-static void
-demu_poll_iopages(void)
+int
+demu_register_fd(int fd, int (*fn)(void *ptr), void *ptr)
 {
-    evtchn_port_t   port;
-    int             i;
+    struct epoll_event  ev = { .events = EPOLLIN };
+    demu_fd_t           *dfd;
 
-    if (demu_state.seq != DEMU_SEQ_INITIALIZED)
-        return;
+    assert(fn);
 
-    port = xenevtchn_pending(demu_state.xeh);
-    if (port < 0)
-        return;
+    dfd = malloc(sizeof (demu_fd_t));
+    if (dfd == NULL)
+        goto fail1;
 
-    for (i = 0; i < demu_state.vcpus; i++) {
-        if (port == demu_state.ioreq_local_port[i]) {
-            xenevtchn_unmask(demu_state.xeh, port);
-            demu_poll_shared_iopage(i);
+    dfd->fd = fd;
+    dfd->fn = fn;
+    dfd->ptr = ptr;
+
+    ev.data.ptr = dfd;
+    if (epoll_ctl(demu_state.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        goto fail2;
+
+    dfd->next = demu_state.fds;
+    demu_state.fds = dfd;
+
+    return 0;
+
+fail2:
+    DBG("fail2\n");
+
+    free(dfd);
+
+fail1:
+    DBG("fail1\n");
+    warn("fail");
+    return -1;
+}
+
+void
+demu_deregister_fd(int fd)
+{
+    demu_fd_t   **dfdp;
+    demu_fd_t   *dfd;
+
+    dfdp = &demu_state.fds;
+    while ((dfd = *dfdp) != NULL) {
+        if (fd == dfd->fd) {
+            *dfdp = dfd->next;
+            (void) epoll_ctl(demu_state.epfd, EPOLL_CTL_DEL, fd, NULL);
+            free(dfd);
+            return;
         }
+        dfdp = &(dfd->next);
     }
 }
 
@@ -1089,6 +2240,7 @@ main(int argc, char **argv, char **envp)
     sigset_t        block;
     int             rc;
     int             efd, xfd;
+    struct epoll_event events[DEMU_MAX_EVENTS];
     char            *devid_str = NULL;
     int             opt;
     const struct option lopts[] =
@@ -1096,10 +2248,13 @@ main(int argc, char **argv, char **envp)
         {"help", no_argument, NULL, 'h'},
         {"devid", optional_argument, NULL, 'd'},
         {"legacy", no_argument, NULL, 'l'},
+        {"map-cache", required_argument, NULL, 'm'},
+        {"grant-cache", required_argument, NULL, 'g'},
+        {"vcpu-threads", no_argument, NULL, 't'},
         {NULL, 0, NULL, 0},
     };
 
-    while ((opt = getopt_long(argc, argv, "hd:l", lopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hd:lm:g:t", lopts, NULL)) != -1) {
         switch (opt) {
             case 'd':
                 devid_str = optarg;
@@ -1109,10 +2264,32 @@ main(int argc, char **argv, char **envp)
                 virtio_legacy = true;
                 break;
 
+            case 'm':
+                /* Size of the guest mapping cache in MiB, 0 disables it */
+                demu_state.mapcache_size = strtoull(optarg, NULL, 0) << 20;
+                break;
+
+            case 'g':
+                /*
+                 * Size of the grant mapping cache in MiB, 0 disables it.
+                 * Only used with frontends which opt in, see
+                 * demu_frontend_started().
+                 */
+                demu_state.gntcache_size = strtoull(optarg, NULL, 0) << 20;
+                break;
+
+            case 't':
+                /* Serve each vCPU's ioreqs from a thread of its own */
+                demu_state.vcpu_threads = true;
+                break;
+
             case 'h':
                 /* Fallthough */
             default:
-                printf("Usage: %s [-d <devid>] [-l (virtio_legacy)]\n", argv[0]);
+                printf("Usage: %s [-d <devid>] [-l (virtio_legacy)] "
+                       "[-m <map cache MiB>] [-g <grant cache MiB>] "
+                       "[-t (vcpu_threads)]\n",
+                       argv[0]);
                 return 0;
         }
     }
@@ -1151,6 +2328,21 @@ main(int argc, char **argv, char **envp)
     demu_state.be_domid = rc;
     DBG("read backend domid %u\n", demu_state.be_domid);
 
+    demu_state.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (demu_state.epfd < 0) {
+        xenstore_destroy(demu_state.xs_dev);
+        fprintf(stderr, "failed to create epoll instance\n");
+        exit(1);
+    }
+
+    xfd = xenstore_get_fd(demu_state.xs_dev);
+    if (demu_register_fd(xfd, demu_poll_xenstore, NULL) < 0) {
+        close(demu_state.epfd);
+        xenstore_destroy(demu_state.xs_dev);
+        fprintf(stderr, "failed to poll xenstore\n");
+        exit(1);
+    }
+
     while (1) {
         rc = xenstore_wait_fe_domid(demu_state.xs_dev);
         if (rc < 0) {
@@ -1168,43 +2360,48 @@ main(int argc, char **argv, char **envp)
         }
 
         efd = xenevtchn_fd(demu_state.xeh);
-        xfd = xenstore_get_fd(demu_state.xs_dev);
+        rc = demu_register_fd(efd, demu_poll_iopages, NULL);
+        if (rc < 0) {
+            demu_teardown();
+            continue;
+        }
 
         while (1) {
-            int nfds;
-            fd_set fds;
-            struct timeval t = { .tv_sec = 1 };
-
-            FD_ZERO(&fds);
-            FD_SET(efd, &fds);
-            FD_SET(xfd, &fds);
-            nfds = __max(efd, xfd) + 1;
-
-            rc = select(nfds, &fds, NULL, NULL, &t);
-            if (rc > 0) {
-                if (FD_ISSET(efd, &fds))
-                    demu_poll_iopages();
-
-                if (FD_ISSET(xfd, &fds)) {
-                    rc = xenstore_poll_watches(demu_state.xs_dev);
-                    if (rc < 0) {
-                        DBG("lost connection to dom%d\n", demu_state.domid);
-                        rc = 0;
-                        break;
-                    }
-                }
+            int i, n;
+
+            n = epoll_wait(demu_state.epfd, events, DEMU_MAX_EVENTS, -1);
+            if (n < 0) {
+                rc = (errno == EINTR) ? 0 : -1;
+                if (rc < 0)
+                    break;
+                continue;
+            }
+
+            for (i = 0; i < n; i++) {
+                demu_fd_t *dfd = events[i].data.ptr;
+
+                /* A handler failing means the frontend went away */
+                rc = dfd->fn(dfd->ptr);
+                if (rc < 0)
+                    break;
             }
 
-            if (rc < 0 && errno != EINTR)
+            if (rc < 0) {
+                rc = 0;
                 break;
+            }
         }
 
+        demu_deregister_fd(efd);
         demu_teardown();
 
         if (rc < 0)
            break;
     }
 
+    demu_deregister_fd(xfd);
+    close(demu_state.epfd);
+
     xenstore_destroy(demu_state.xs_dev);
 
     return 0;
@@ -28,6 +28,8 @@
  */
 
 #include <xenctrl.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 
 #ifndef  _DEMU_H
@@ -41,18 +43,39 @@ void    demu_set_irq(int irq, int level);
 
 #define	P2ROUNDUP(_x, _a) -(-(_x) & -(_a))
 
+void    demu_frontend_started(bool started);
+
 void    *demu_map_guest_range(uint64_t addr, uint64_t size, int prot);
 int     demu_unmap_guest_range(void *ptr, uint64_t size);
 
+/*
+ * Mapping of a whole descriptor chain. Device-readable segments come first
+ * and are mapped read-only, device-writable ones follow. When possible all
+ * of them are mapped with a single call into one contiguous window (two for
+ * grants, one per protection).
+ */
+struct demu_iov_mapping {
+    bool            batched;
+    void            *va[2];
+    unsigned int    n[2];
+};
+
+/* On entry iov_base holds the guest address of each segment */
+int     demu_map_guest_iov(struct demu_iov_mapping *map, struct iovec iov[],
+                           unsigned int out, unsigned int in);
+void    demu_unmap_guest_iov(struct demu_iov_mapping *map, struct iovec iov[],
+                             unsigned int n);
+
 int demu_register_memory_space(uint64_t start, uint64_t size,
     void (*mmio_fn)(u64 addr, u8 *data, u32 len, u8 is_write, void *ptr),
     void *ptr);
 
 void demu_deregister_memory_space(uint64_t start);
 
-#ifdef MAP_IN_ADVANCE
-void *demu_get_host_addr(uint64_t offset);
-#endif
+/* Have fn called from the main loop whenever fd becomes readable */
+int demu_register_fd(int fd, int (*fn)(void *ptr), void *ptr);
+
+void demu_deregister_fd(int fd);
 
 #endif  /* _DEMU_H */
 
@@ -2,149 +2,290 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 
-#include "kvm/brlock.h"
 #include "kvm/disk-image.h"
 #include "kvm/kvm.h"
-#include "linux/list.h"
 
+/*
+ * Requests are gathered into a batch while the disk is plugged and handed
+ * to the kernel with a single io_submit() on unplug. One thread per disk
+ * reaps the completions, signalled through an eventfd.
+ *
+ * inflight counts both batched and submitted requests and never exceeds
+ * the size of the context: submitters block on 'room' instead of getting
+ * -EAGAIN back from io_submit().
+ */
 #define AIO_MAX 256
 
-static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
+struct disk_aio {
+	io_context_t		ctx;
+	int			evt;
+	unsigned int		max;
+
+	pthread_mutex_t		sq_lock;
+	struct iocb		iocbs[AIO_MAX];
+	struct iocb		*ios[AIO_MAX];
+	unsigned int		nr;
+
+	pthread_t		thread;
+	bool			stop;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		room;
+	pthread_cond_t		idle;
+	u64			inflight;
+};
+
+static void aio_put(struct disk_aio *a, unsigned int nr)
 {
-	int ret;
-
-	__sync_fetch_and_add(&disk->aio_inflight, nr);
-	/*
-	 * A wmb() is needed here, to ensure disk_aio_thread() sees this
-	 * increase after receiving the events. It is included in the
-	 * __sync_fetch_and_add (as a full barrier).
-	 */
-restart:
-	ret = io_submit(disk->ctx, nr, ios);
-	if (ret == -EAGAIN)
-		goto restart;
-	else if (ret <= 0)
-		/* disk_aio_thread() is never going to see those */
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
-
-	return ret;
+	pthread_mutex_lock(&a->lock);
+	a->inflight -= nr;
+	pthread_cond_broadcast(&a->room);
+	if (a->inflight == 0)
+		pthread_cond_broadcast(&a->idle);
+	pthread_mutex_unlock(&a->lock);
 }
 
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount,
-			      void *param)
+/*
+ * Called with sq_lock held. The kernel copies the iocbs (and their iovec
+ * arrays) during io_submit(), so the batch can be reused straight away.
+ */
+static void aio_flush(struct disk_image *disk)
 {
-	struct iocb iocb;
-	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
+	struct disk_aio *a = disk->engine_priv;
+	unsigned int done = 0, i;
+	int r;
+
+	while (done < a->nr) {
+		r = io_submit(a->ctx, a->nr - done, a->ios + done);
+		if (r > 0) {
+			done += r;
+			continue;
+		}
+
+		if (r == -EAGAIN) {
+			/* Out of kernel resources, wait for a completion */
+			pthread_mutex_lock(&a->lock);
+			r = a->inflight > a->nr - done;
+			if (r)
+				pthread_cond_wait(&a->room, &a->lock);
+			pthread_mutex_unlock(&a->lock);
+			if (r)
+				continue;
+			r = -EAGAIN;
+		}
 
-	io_prep_preadv(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+		/* The rest of the batch is never going to complete */
+		pr_warning("io_submit failed: %d", r);
+		for (i = done; i < a->nr; i++)
+			disk->disk_req_cb(a->ios[i]->data, r ? : -EIO);
+		disk_image__end_batch(disk);
+		aio_put(a, a->nr - done);
+		break;
+	}
 
-	return aio_submit(disk, 1, ios);
+	a->nr = 0;
 }
 
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount,
-			       void *param)
+static ssize_t aio_queue_rw(struct disk_image *disk, bool write, u64 sector,
+			    const struct iovec *iov, int iovcount, void *param)
 {
-	struct iocb iocb;
+	struct disk_aio *a = disk->engine_priv;
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
+	struct iocb *iocb;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	pthread_mutex_lock(&a->sq_lock);
+
+	pthread_mutex_lock(&a->lock);
+	if (a->inflight >= a->max) {
+		/* Don't wait on requests we are sitting on */
+		pthread_mutex_unlock(&a->lock);
+		aio_flush(disk);
+		pthread_mutex_lock(&a->lock);
+		while (a->inflight >= a->max)
+			pthread_cond_wait(&a->room, &a->lock);
+	}
+	a->inflight++;
+	pthread_mutex_unlock(&a->lock);
+
+	iocb = &a->iocbs[a->nr];
+	if (write)
+		io_prep_pwritev2(iocb, disk->fd, iov, iovcount, offset,
+				 disk_image__writethrough(disk) ? RWF_DSYNC : 0);
+	else
+		io_prep_preadv(iocb, disk->fd, iov, iovcount, offset);
+	io_set_eventfd(iocb, a->evt);
+	iocb->data = param;
+	a->ios[a->nr++] = iocb;
+
+	if (!disk_image__plugged() || a->nr == AIO_MAX)
+		aio_flush(disk);
 
-	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
-	io_set_eventfd(&iocb, disk->evt);
-	iocb.data = param;
+	pthread_mutex_unlock(&a->sq_lock);
 
-	return aio_submit(disk, 1, ios);
+	return len;
+}
+
+static ssize_t aio_read(struct disk_image *disk, u64 sector,
+			const struct iovec *iov, int iovcount, void *param)
+{
+	return aio_queue_rw(disk, false, sector, iov, iovcount, param);
+}
+
+static ssize_t aio_write(struct disk_image *disk, u64 sector,
+			 const struct iovec *iov, int iovcount, void *param)
+{
+	return aio_queue_rw(disk, true, sector, iov, iovcount, param);
+}
+
+static void aio_unplug(struct disk_image *disk)
+{
+	struct disk_aio *a = disk->engine_priv;
+
+	pthread_mutex_lock(&a->sq_lock);
+	if (a->nr)
+		aio_flush(disk);
+	pthread_mutex_unlock(&a->sq_lock);
 }
 
 /*
- * When this function returns there are no in-flight I/O. Caller ensures that
- * io_submit() isn't called concurrently.
- *
- * Returns an inaccurate number of I/O that was in-flight when the function was
- * called.
+ * When this function returns there are no in-flight I/O. Returns the number
+ * of I/O that were in-flight when it was called.
  */
-int raw_image__wait(struct disk_image *disk)
+static int aio_wait(struct disk_image *disk)
 {
-	u64 inflight = disk->aio_inflight;
+	struct disk_aio *a = disk->engine_priv;
+	u64 inflight;
 
-	while (disk->aio_inflight) {
-		usleep(100);
-		barrier();
-	}
+	aio_unplug(disk);
+
+	pthread_mutex_lock(&a->lock);
+	inflight = a->inflight;
+	while (a->inflight)
+		pthread_cond_wait(&a->idle, &a->lock);
+	pthread_mutex_unlock(&a->lock);
 
 	return inflight;
 }
 
-static int disk_aio_get_events(struct disk_image *disk)
+static void aio_get_events(struct disk_image *disk)
 {
+	struct disk_aio *a = disk->engine_priv;
 	struct io_event event[AIO_MAX];
 	struct timespec notime = {0};
 	int nr, i;
 
 	do {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		nr = io_getevents(a->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		if (nr <= 0)
+			break;
+
 		for (i = 0; i < nr; i++)
 			disk->disk_req_cb(event[i].data, event[i].res);
+		disk_image__end_batch(disk);
 
-		/* Pairs with wmb() in aio_submit() */
-		rmb();
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
-
-	} while (nr > 0);
-
-	return 0;
+		aio_put(a, nr);
+	} while (nr == ARRAY_SIZE(event));
 }
 
-static void *disk_aio_thread(void *param)
+static void *aio_thread(void *arg)
 {
-	struct disk_image *disk = param;
+	struct disk_image *disk = arg;
+	struct disk_aio *a = disk->engine_priv;
 	u64 dummy;
 
 	kvm__set_thread_name("disk-image-io");
 
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		if (disk_aio_get_events(disk))
+	while (read(a->evt, &dummy, sizeof(dummy)) > 0) {
+		aio_get_events(disk);
+
+		if (a->stop)
 			break;
 	}
 
 	return NULL;
 }
 
-int disk_aio_setup(struct disk_image *disk)
+static int aio_setup(struct disk_image *disk)
 {
+	struct disk_aio *a;
 	int r;
 
-	/* No need to setup AIO if the disk ops won't make use of it */
-	if (!disk->ops->async)
-		return 0;
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -ENOMEM;
 
-	disk->evt = eventfd(0, 0);
-	if (disk->evt < 0)
-		return -errno;
+	/* Room for every request of every queue */
+	a->max = DISK_IO_DEPTH_MAX * (disk->num_queues ? : 1);
 
-	io_setup(AIO_MAX, &disk->ctx);
-	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
-	if (r) {
+	a->evt = eventfd(0, EFD_CLOEXEC);
+	if (a->evt < 0) {
 		r = -errno;
-		close(disk->evt);
-		return r;
+		goto err_free;
+	}
+
+	r = io_setup(a->max, &a->ctx);
+	if (r < 0)
+		goto err_close;
+
+	pthread_mutex_init(&a->sq_lock, NULL);
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->room, NULL);
+	pthread_cond_init(&a->idle, NULL);
+
+	disk->engine_priv = a;
+
+	r = pthread_create(&a->thread, NULL, aio_thread, disk);
+	if (r) {
+		r = -r;
+		disk->engine_priv = NULL;
+		goto err_destroy;
 	}
 
-	disk->async = true;
 	return 0;
+
+err_destroy:
+	io_destroy(a->ctx);
+err_close:
+	close(a->evt);
+err_free:
+	free(a);
+	return r;
 }
 
-void disk_aio_destroy(struct disk_image *disk)
+static void aio_destroy(struct disk_image *disk)
 {
-	if (!disk->async)
-		return;
+	struct disk_aio *a = disk->engine_priv;
+	u64 one = 1;
+
+	aio_wait(disk);
 
-	pthread_cancel(disk->thread);
-	pthread_join(disk->thread, NULL);
-	close(disk->evt);
-	io_destroy(disk->ctx);
+	a->stop = true;
+	if (write(a->evt, &one, sizeof(one)) < 0)
+		pthread_cancel(a->thread);
+	pthread_join(a->thread, NULL);
+
+	io_destroy(a->ctx);
+	close(a->evt);
+	pthread_cond_destroy(&a->idle);
+	pthread_cond_destroy(&a->room);
+	pthread_mutex_destroy(&a->lock);
+	pthread_mutex_destroy(&a->sq_lock);
+	free(a);
+
+	disk->engine_priv = NULL;
 }
+
+const struct disk_io_engine disk_aio_engine = {
+	.name		= "aio",
+	.setup		= aio_setup,
+	.destroy	= aio_destroy,
+	.read		= aio_read,
+	.write		= aio_write,
+	.unplug		= aio_unplug,
+	.wait		= aio_wait,
+};
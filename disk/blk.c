@@ -1,18 +1,67 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
+#include <limits.h>
 #include <mntent.h>
+#include <stdio.h>
+#include <sys/sysmacros.h>
+
+static int blkdev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (ioctl(disk->fd, BLKDISCARD, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The kernel unmaps or writes zeroes, whichever the device does best */
+static int blkdev__write_zeroes(struct disk_image *disk, u64 sector,
+				u64 nr_sectors, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+		return -errno;
+
+	return 0;
+}
 
 /*
  * raw image and blk dev are similar, so reuse raw image ops.
  */
 static struct disk_image_operations blk_dev_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.wait		= raw_image__wait,
+	.discard	= blkdev__discard,
+	.write_zeroes	= blkdev__write_zeroes,
+	.async		= true,
 };
 
+/* Reads a limit of the device's request queue from sysfs, 0 if unknown */
+static u64 blkdev__queue_limit(struct stat *st, const char *name)
+{
+	char path[PATH_MAX];
+	unsigned long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(st->st_rdev), minor(st->st_rdev), name);
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+
+	fclose(f);
+	return val;
+}
+
 static bool is_mounted(struct stat *st)
 {
 	struct stat st_buf;
@@ -37,7 +86,10 @@ static bool is_mounted(struct stat *st)
 
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st)
 {
-	int fd, r;
+	struct disk_image *disk;
+	unsigned short max_sectors;
+	unsigned int val;
+	int fd, r, ssz;
 	u64 size;
 
 	if (!S_ISBLK(st->st_mode))
@@ -68,5 +120,32 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 * mmap large disk. There is not enough virtual address space
 	 * in 32-bit host. However, this works on 64-bit host.
 	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	disk = disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk))
+		return disk;
+
+	/* Larger requests would be split by the block layer anyway */
+	if (ioctl(fd, BLKSECTGET, &max_sectors) == 0)
+		disk->max_sectors = max_sectors;
+
+	if (ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz > SECTOR_SIZE)
+		disk->blk_size = ssz;
+	disk->phys_block_size = disk->blk_size;
+	if (ioctl(fd, BLKPBSZGET, &val) == 0 && val > disk->blk_size)
+		disk->phys_block_size = val;
+	if (ioctl(fd, BLKALIGNOFF, &ssz) == 0 && ssz > 0)
+		disk->align_offset = ssz;
+	if (ioctl(fd, BLKIOMIN, &val) == 0)
+		disk->io_min = val;
+	if (ioctl(fd, BLKIOOPT, &val) == 0)
+		disk->io_opt = val;
+
+	/* BLKZEROOUT writes the zeroes itself if the device can't */
+	disk->discard_max_sectors = min_t(u64, DISK_DISCARD_SECTORS_MAX,
+			blkdev__queue_limit(st, "discard_max_bytes") >> SECTOR_SHIFT);
+	disk->discard_granularity = max_t(u64, 1,
+			blkdev__queue_limit(st, "discard_granularity") >> SECTOR_SHIFT);
+	disk->write_zeroes_max_sectors = DISK_DISCARD_SECTORS_MAX;
+
+	return disk;
 }
@@ -4,10 +4,24 @@
 #include "kvm/kvm.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <poll.h>
 
 int debug_iodelay;
 
+static const struct disk_io_engine *disk_io_engines[] = {
+	&disk_threads_engine,
+#ifdef CONFIG_HAS_AIO
+	&disk_aio_engine,
+#endif
+#ifdef CONFIG_HAS_IO_URING
+	&disk_uring_engine,
+#endif
+};
+
+/* Requests issued while plugged are only submitted on unplug */
+static __thread int disk_plug_depth;
+
 static int disk_image__close(struct disk_image *disk);
 
 #if 0
@@ -65,9 +79,12 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		return ERR_PTR(-ENOMEM);
 
 	*disk = (struct disk_image) {
-		.fd	= fd,
-		.size	= size,
-		.ops	= ops,
+		.fd		= fd,
+		.size		= size,
+		.ops		= ops,
+		.max_segments	= DISK_IOV_MAX,
+		.blk_size	= SECTOR_SIZE,
+		.phys_block_size = SECTOR_SIZE,
 	};
 
 	if (use_mmap == DISK_IMAGE_MMAP) {
@@ -81,15 +98,8 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		}
 	}
 
-	r = disk_aio_setup(disk);
-	if (r)
-		goto err_unmap_disk;
-
 	return disk;
 
-err_unmap_disk:
-	if (disk->priv)
-		munmap(disk->priv, size);
 err_free_disk:
 	free(disk);
 	return ERR_PTR(r);
@@ -152,7 +162,7 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 	bool readonly;
 	bool direct;
 	void *err;
-	int i;
+	int i, r;
 	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
 	int count = kvm->cfg.image_count;
 
@@ -194,6 +204,49 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 
 		disks[i]->addr = params[i].addr;
 		disks[i]->irq = params[i].irq;
+		disks[i]->num_queues = params[i].num_queues;
+		disks[i]->cpus = params[i].cpus;
+		disks[i]->irq_coalesce_count = params[i].irq_coalesce_count;
+		disks[i]->irq_coalesce_usecs = params[i].irq_coalesce_usecs;
+		disks[i]->poll_usecs = params[i].poll_usecs;
+		disks[i]->cache_mode = params[i].cache_mode;
+		disk_image__set_writeback(disks[i],
+				params[i].cache_mode != DISK_CACHE_WRITETHROUGH);
+
+		if (direct) {
+			/* Only raw images and block devices know how to bounce */
+			r = disks[i]->ops->async ? disk_direct__setup(disks[i]) : -ENOTSUP;
+			if (r < 0) {
+				pr_warning("%s: O_DIRECT unusable, using the page cache",
+					   filename);
+				fcntl(disks[i]->fd, F_SETFL,
+				      fcntl(disks[i]->fd, F_GETFL) & ~O_DIRECT);
+			} else {
+				disks[i]->direct = true;
+			}
+		}
+
+		disks[i]->io_threads = params[i].io_threads;
+		if (params[i].io_engine) {
+			r = disk_image__set_engine(disks[i], params[i].io_engine,
+						   params[i].io_flags);
+			if (r < 0)
+				pr_warning("%s: using synchronous I/O", filename);
+		}
+
+		if (params[i].readahead_kb) {
+			r = disk_readahead__setup(disks[i], params[i].readahead_kb);
+			if (r < 0)
+				pr_warning("%s: readahead disabled", filename);
+		}
+
+		/* fdatasync() is enough for the disks which have no flush op */
+		if (disks[i]->ops->async && !disks[i]->ops->flush &&
+		    disks[i]->cache_mode != DISK_CACHE_UNSAFE) {
+			r = disk_flusher__setup(disks[i]);
+			if (r < 0)
+				pr_warning("%s: using synchronous flushes", filename);
+		}
 	}
 
 	return disks;
@@ -206,29 +259,154 @@ error:
 	return err;
 }
 
+int disk_image__set_engine(struct disk_image *disk, const char *name,
+			   unsigned int flags)
+{
+	const struct disk_io_engine *engine = NULL;
+	unsigned int i;
+	int r;
+
+	if (!strcmp(name, "sync"))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(disk_io_engines); i++) {
+		if (!strcmp(name, disk_io_engines[i]->name))
+			engine = disk_io_engines[i];
+	}
+
+	if (!engine) {
+		pr_warning("I/O engine '%s' is not available", name);
+		return -ENOENT;
+	}
+
+	/* The kernel interfaces only do raw images and block devices */
+	if (!engine->any_format && !disk->ops->async) {
+		pr_warning("I/O engine '%s' does not support this format", name);
+		return -EINVAL;
+	}
+
+	disk->io_flags = flags;
+	r = engine->setup(disk);
+	if (r < 0) {
+		pr_warning("I/O engine '%s' setup failed: %d", name, r);
+		return r;
+	}
+
+	disk->engine = engine;
+	disk->async = true;
+
+	pr_info("using %s I/O engine", name);
+
+	return 0;
+}
+
+void disk_image__plug(struct disk_image *disk)
+{
+	disk_plug_depth++;
+}
+
+void disk_image__unplug(struct disk_image *disk)
+{
+	if (--disk_plug_depth)
+		return;
+
+	if (disk->engine && disk->engine->unplug)
+		disk->engine->unplug(disk);
+}
+
+bool disk_image__plugged(void)
+{
+	return disk_plug_depth > 0;
+}
+
 int disk_image__wait(struct disk_image *disk)
 {
+	int r = disk_flusher__wait(disk);
+
+	if (disk->engine)
+		return r + disk->engine->wait(disk);
+
 	if (disk->ops->wait)
-		return disk->ops->wait(disk);
+		return r + disk->ops->wait(disk);
 
-	return 0;
+	return r;
 }
 
 int disk_image__flush(struct disk_image *disk)
 {
+	if (disk->cache_mode == DISK_CACHE_UNSAFE)
+		return 0;
+
 	if (disk->ops->flush)
 		return disk->ops->flush(disk);
 
 	return fsync(disk->fd);
 }
 
+/* Unsafe disks never sync, whatever the guest asks for */
+void disk_image__set_writeback(struct disk_image *disk, bool writeback)
+{
+	bool writethrough = !writeback && disk->cache_mode != DISK_CACHE_UNSAFE;
+
+	if (writethrough != disk_image__writethrough(disk))
+		pr_info("switching to %s cache mode",
+			writethrough ? "writethrough" : "writeback");
+
+	__atomic_store_n(&disk->writethrough, writethrough, __ATOMIC_RELAXED);
+}
+
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	int r;
+
+	if (disk->readonly)
+		return -EROFS;
+
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	/* Synchronous: invalidating before and after covers readahead in flight */
+	if (disk->readahead)
+		disk_readahead__invalidate(disk, sector, nr_sectors);
+	r = disk->ops->discard(disk, sector, nr_sectors);
+	if (disk->readahead)
+		disk_readahead__invalidate(disk, sector, nr_sectors);
+
+	return r;
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap)
+{
+	int r;
+
+	if (disk->readonly)
+		return -EROFS;
+
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	if (disk->readahead)
+		disk_readahead__invalidate(disk, sector, nr_sectors);
+	r = disk->ops->write_zeroes(disk, sector, nr_sectors, unmap);
+	if (disk->readahead)
+		disk_readahead__invalidate(disk, sector, nr_sectors);
+
+	return r;
+}
+
 static int disk_image__close(struct disk_image *disk)
 {
 	/* If there was no disk image then there's nothing to do: */
 	if (!disk)
 		return 0;
 
-	disk_aio_destroy(disk);
+	disk_readahead__destroy(disk);
+	disk_flusher__destroy(disk);
+	disk_direct__destroy(disk);
+
+	if (disk->engine)
+		disk->engine->destroy(disk);
 
 	if (disk->ops->close)
 		return disk->ops->close(disk);
@@ -263,12 +441,28 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->read) {
-		total = disk->ops->read(disk, sector, iov, iovcount, param);
+	if (disk->direct &&
+	    disk_direct__sync(disk, false, sector, iov, iovcount, &total)) {
+		if (total < 0)
+			pr_info("disk_image__read error: total=%ld\n", (long)total);
+		/* Done synchronously, whatever the engine */
+		if (disk->disk_req_cb)
+			disk->disk_req_cb(param, total);
+		return total;
+	}
+
+	if (disk->engine) {
+		total = disk->engine->read(disk, sector, iov, iovcount, param);
 		if (total < 0) {
 			pr_info("disk_image__read error: total=%ld\n", (long)total);
+			/* Never submitted, complete it here */
+			disk->disk_req_cb(param, total);
 			return total;
 		}
+	} else if (disk->ops->read) {
+		total = disk->ops->read(disk, sector, iov, iovcount, param);
+		if (total < 0)
+			pr_info("disk_image__read error: total=%ld\n", (long)total);
 	}
 
 	if (!disk->async && disk->disk_req_cb)
@@ -285,20 +479,43 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 			  const struct iovec *iov, int iovcount, void *param)
 {
 	ssize_t total = 0;
+	int r;
 
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->write) {
+	if (disk->direct &&
+	    disk_direct__sync(disk, true, sector, iov, iovcount, &total)) {
+		if (total < 0)
+			pr_info("disk_image__write error: total=%ld\n", (long)total);
+		/* Done synchronously, whatever the engine */
+		if (disk->disk_req_cb)
+			disk->disk_req_cb(param, total);
+		return total;
+	}
+
+	if (disk->engine) {
+		total = disk->engine->write(disk, sector, iov, iovcount, param);
+		if (total < 0) {
+			pr_info("disk_image__write error: total=%ld\n", (long)total);
+			/* Never submitted, complete it here */
+			disk->disk_req_cb(param, total);
+			return total;
+		}
+	} else if (disk->ops->write) {
 		/*
 		 * Try writev based operation first
 		 */
 
 		total = disk->ops->write(disk, sector, iov, iovcount, param);
-		if (total < 0) {
-			pr_info("disk_image__write error: total=%ld\n", (long)total);
-			return total;
+		if (total >= 0 && disk_image__writethrough(disk)) {
+			/* Engines sync each write themselves */
+			r = disk_image__flush(disk);
+			if (r < 0)
+				total = r;
 		}
+		if (total < 0)
+			pr_info("disk_image__write error: total=%ld\n", (long)total);
 	} else {
 		/* Do nothing */
 	}
@@ -309,6 +526,29 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 	return total;
 }
 
+/* Copy len bytes between buf and the iov array, at offset off of the latter */
+void disk_image__copy_iov(const struct iovec *iov, int iovcount, size_t off,
+			  void *buf, size_t len, bool to_iov)
+{
+	size_t chunk;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
+
+		chunk = min(iov->iov_len - off, len);
+		if (to_iov)
+			memcpy(iov->iov_base + off, buf, chunk);
+		else
+			memcpy(buf, iov->iov_base + off, chunk);
+		buf += chunk;
+		len -= chunk;
+		off = 0;
+	}
+}
+
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len)
 {
 	struct stat st;
@@ -331,6 +571,24 @@ void disk_image__set_callback(struct disk_image *disk,
 	disk->disk_req_cb = disk_req_cb;
 }
 
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_req_batch_cb)(void *param),
+				    void *param)
+{
+	disk->disk_req_batch_cb = disk_req_batch_cb;
+	disk->disk_req_cb_param = param;
+}
+
+/*
+ * Engines call this after completing a batch of requests, so that the
+ * device can publish them to the guest (and interrupt it) in one go.
+ */
+void disk_image__end_batch(struct disk_image *disk)
+{
+	if (disk->disk_req_batch_cb)
+		disk->disk_req_batch_cb(disk->disk_req_cb_param);
+}
+
 int disk_image__init(struct kvm *kvm)
 {
 	if (kvm->cfg.image_count) {
@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+
+/*
+ * O_DIRECT support.
+ *
+ * Guest buffers are mapped pages, so requests which respect the disk's
+ * alignment go to the backend as they are. The others, which the kernel
+ * would fail with EINVAL, are bounced through a buffer aligned for the
+ * whole vector: O_DIRECT checks the alignment of every segment, bouncing
+ * only some of them would not help. So are all requests if the guest
+ * buffers can't be pinned at all, see disk_direct__sync().
+ *
+ * Bouncing is synchronous and done by the submitting thread, with a buffer
+ * it keeps for itself until it exits: queue workers come and go with device
+ * resets. The pool is reserved at setup but left untouched, so that the
+ * pages of each buffer are allocated on the node of the (pinned) queue
+ * worker which first uses it.
+ */
+enum {
+	DISK_DIO_PIN_UNKNOWN,
+	DISK_DIO_PIN_OK,
+	DISK_DIO_PIN_NONE,
+};
+
+struct disk_bounce_slot {
+	struct disk_bounce_pool	*pool;
+	struct disk_bounce_slot	*next;
+	void			*buf;
+};
+
+struct disk_bounce_pool {
+	pthread_mutex_t		lock;
+	/* Serializes read-modify-write of partial blocks */
+	pthread_mutex_t		rmw_lock;
+	void			*base;
+	unsigned int		nr;
+	struct disk_bounce_slot	*slots;
+	struct disk_bounce_slot	*free;
+	/* The slot of each thread */
+	pthread_key_t		key;
+};
+
+/* Called when a thread holding a slot exits */
+static void disk_direct__put_slot(void *arg)
+{
+	struct disk_bounce_slot *slot = arg;
+	struct disk_bounce_pool *pool = slot->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	slot->next = pool->free;
+	pool->free = slot;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *disk_direct__get_buf(struct disk_bounce_pool *pool)
+{
+	struct disk_bounce_slot *slot;
+
+	slot = pthread_getspecific(pool->key);
+	if (slot)
+		return slot->buf;
+
+	pthread_mutex_lock(&pool->lock);
+	slot = pool->free;
+	if (slot)
+		pool->free = slot->next;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!slot)
+		return NULL;
+
+	if (pthread_setspecific(pool->key, slot)) {
+		disk_direct__put_slot(slot);
+		return NULL;
+	}
+
+	return slot->buf;
+}
+
+static bool disk_direct__pool_buf(struct disk_bounce_pool *pool, void *buf)
+{
+	return buf >= pool->base &&
+	       buf < pool->base + (size_t)pool->nr * DISK_BOUNCE_SIZE;
+}
+
+bool disk_direct__aligned(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount)
+{
+	unsigned long mem = 0, len = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		mem |= (unsigned long)iov[i].iov_base;
+		len |= iov[i].iov_len;
+	}
+
+	return !((sector << SECTOR_SHIFT | len) & (disk->dio_align - 1)) &&
+	       !(mem & (disk->dio_mem_align - 1));
+}
+
+/*
+ * The request is done in windows of up to DISK_BOUNCE_SIZE, widened to
+ * whole blocks. Partially written blocks are read first. The last block
+ * of an image whose size isn't a multiple of them is written past the
+ * end, zeroed there, and the image cut back to size.
+ */
+ssize_t disk_direct__bounce(struct disk_image *disk, bool write, u64 sector,
+			    const struct iovec *iov, int iovcount)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+	u64 align = disk->dio_align;
+	u64 start = sector << SECTOR_SHIFT;
+	u64 pos, end, wstart, wend, tail;
+	size_t chunk, len = 0;
+	bool partial;
+	ssize_t r = 0;
+	void *buf;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+	end = start + len;
+
+	buf = disk_direct__get_buf(pool);
+	if (!buf && posix_memalign(&buf, DISK_BOUNCE_ALIGN, DISK_BOUNCE_SIZE))
+		return -ENOMEM;
+
+	for (pos = start; pos < end; pos += chunk) {
+		wstart = pos & ~(align - 1);
+		wend = min(ALIGN(end, align), wstart + DISK_BOUNCE_SIZE);
+		chunk = min(end, wend) - pos;
+		partial = pos != wstart || pos + chunk != wend;
+
+		if (!write) {
+			r = pread_in_full(disk->fd, buf, wend - wstart, wstart);
+			if (r < 0) {
+				r = -errno;
+				break;
+			}
+			disk_image__copy_iov(iov, iovcount, pos - start,
+					     buf + (pos - wstart), chunk, true);
+			continue;
+		}
+
+		/* Past the end is only ever in a partial window */
+		tail = wend > disk->size ? wend - disk->size : 0;
+
+		if (partial) {
+			pthread_mutex_lock(&pool->rmw_lock);
+			r = pread_in_full(disk->fd, buf, wend - wstart, wstart);
+			if (r < 0) {
+				r = -errno;
+				pthread_mutex_unlock(&pool->rmw_lock);
+				break;
+			}
+			if (tail)
+				memset(buf + (disk->size - wstart), 0, tail);
+		}
+
+		disk_image__copy_iov(iov, iovcount, pos - start,
+				     buf + (pos - wstart), chunk, false);
+		r = pwrite_in_full(disk->fd, buf, wend - wstart, wstart);
+		if (r < 0)
+			r = -errno;
+		else if (tail && ftruncate(disk->fd, disk->size) < 0)
+			r = -errno;
+
+		if (partial)
+			pthread_mutex_unlock(&pool->rmw_lock);
+		if (r < 0)
+			break;
+	}
+
+	if (!disk_direct__pool_buf(pool, buf))
+		free(buf);
+
+	if (r < 0)
+		return r;
+
+	if (write && disk_image__writethrough(disk)) {
+		r = disk_image__flush(disk);
+		if (r < 0)
+			return r;
+	}
+
+	return len;
+}
+
+/*
+ * Do the requests O_DIRECT can't take as they are. Besides misaligned
+ * ones, that is all of them when the guest buffers can't be pinned:
+ * privcmd foreign mappings are VM_IO | VM_PFNMAP, which get_user_pages()
+ * fails with EFAULT. The first aligned request is done here to find out,
+ * synchronously, and bounced if it faults, as are all those which follow.
+ *
+ * Returns false if the request is left to the engine.
+ */
+bool disk_direct__sync(struct disk_image *disk, bool write, u64 sector,
+		       const struct iovec *iov, int iovcount, ssize_t *total)
+{
+	u8 pin = __atomic_load_n(&disk->dio_pin, __ATOMIC_RELAXED);
+	ssize_t r;
+	int err;
+
+	if (pin != DISK_DIO_PIN_NONE &&
+	    disk_direct__aligned(disk, sector, iov, iovcount)) {
+		if (pin == DISK_DIO_PIN_OK)
+			return false;
+
+		errno = 0;
+		if (write)
+			r = disk->ops->write(disk, sector, iov, iovcount, NULL);
+		else
+			r = disk->ops->read(disk, sector, iov, iovcount, NULL);
+
+		if (r >= 0 || (r != -EFAULT && errno != EFAULT)) {
+			__atomic_store_n(&disk->dio_pin, DISK_DIO_PIN_OK,
+					 __ATOMIC_RELAXED);
+			if (r >= 0 && write && disk_image__writethrough(disk)) {
+				err = disk_image__flush(disk);
+				if (err < 0)
+					r = err;
+			}
+			*total = r;
+			return true;
+		}
+
+		pr_info("guest buffers can't be pinned, bouncing all requests");
+		__atomic_store_n(&disk->dio_pin, DISK_DIO_PIN_NONE,
+				 __ATOMIC_RELAXED);
+	}
+
+	*total = disk_direct__bounce(disk, write, sector, iov, iovcount);
+	return true;
+}
+
+/* The kernel tells since Linux 6.1, assume 4K blocks before */
+static void disk_direct__get_align(struct disk_image *disk)
+{
+	struct stat st;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (statx(disk->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+	    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+		disk->dio_align = stx.stx_dio_offset_align;
+		disk->dio_mem_align = stx.stx_dio_mem_align;
+		return;
+	}
+#endif
+
+	if (fstat(disk->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+		disk->dio_align = disk->blk_size;
+		disk->dio_mem_align = disk->blk_size;
+	} else {
+		disk->dio_align = DISK_BOUNCE_ALIGN;
+		disk->dio_mem_align = DISK_BOUNCE_ALIGN;
+	}
+}
+
+int disk_direct__setup(struct disk_image *disk)
+{
+	struct disk_bounce_pool *pool;
+	unsigned int i;
+
+	disk_direct__get_align(disk);
+	if (disk->dio_align < SECTOR_SIZE || disk->dio_align > DISK_BOUNCE_ALIGN ||
+	    disk->dio_align & (disk->dio_align - 1))
+		return -EINVAL;
+	if (!disk->dio_mem_align)
+		disk->dio_mem_align = disk->dio_align;
+
+	/*
+	 * The logical block is what the guest formatted the disk with, a
+	 * host caching option must not change it. Requests which follow the
+	 * hints never need bouncing, the others are bounced.
+	 */
+	disk->phys_block_size = max(disk->phys_block_size, disk->dio_align);
+	disk->io_min = max(disk->io_min, disk->dio_align);
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	/* One buffer per queue worker, and one for anybody else */
+	pool->nr = (disk->num_queues ? : 1) + 1;
+	pool->slots = calloc(pool->nr, sizeof(*pool->slots));
+	if (!pool->slots)
+		goto err_free;
+
+	pool->base = mmap(NULL, (size_t)pool->nr * DISK_BOUNCE_SIZE, PROT_RW,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pool->base == MAP_FAILED)
+		goto err_free;
+
+	if (pthread_key_create(&pool->key, disk_direct__put_slot))
+		goto err_unmap;
+
+	for (i = 0; i < pool->nr; i++) {
+		pool->slots[i] = (struct disk_bounce_slot) {
+			.pool	= pool,
+			.next	= pool->free,
+			.buf	= pool->base + (size_t)i * DISK_BOUNCE_SIZE,
+		};
+		pool->free = &pool->slots[i];
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->rmw_lock, NULL);
+
+	disk->bounce = pool;
+
+	return 0;
+
+err_unmap:
+	munmap(pool->base, (size_t)pool->nr * DISK_BOUNCE_SIZE);
+err_free:
+	free(pool->slots);
+	free(pool);
+	return -ENOMEM;
+}
+
+void disk_direct__destroy(struct disk_image *disk)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+
+	if (!pool)
+		return;
+
+	/* Threads still holding a slot won't give it back */
+	pthread_key_delete(pool->key);
+	munmap(pool->base, (size_t)pool->nr * DISK_BOUNCE_SIZE);
+	pthread_mutex_destroy(&pool->rmw_lock);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->slots);
+	free(pool);
+
+	disk->bounce = NULL;
+}
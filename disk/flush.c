@@ -0,0 +1,200 @@
+#include <pthread.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+/*
+ * Background flushes with group commit.
+ *
+ * A flush has to cover the writes completed before it was submitted, so it
+ * can't piggyback on an fdatasync() which is already running: it waits for
+ * the next one, which also serves every other flush that came in meanwhile.
+ * The virtqueues never wait for the disk cache, and N overlapping flushes
+ * cost at most two fdatasync() calls.
+ */
+struct disk_flusher {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	pthread_cond_t		idle;
+	bool			busy;
+	bool			stop;
+
+	/* Flushes waiting for the next fdatasync(), and those it serves */
+	void			**waiting;
+	void			**running;
+	unsigned int		nr;
+	unsigned int		max;
+
+	u64			syncs;
+	u64			flushes;
+};
+
+static int disk_flusher__sync(struct disk_image *disk)
+{
+	if (fdatasync(disk->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void *disk_flusher__thread(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_flusher *f = disk->flusher;
+	unsigned int i, nr;
+	void **batch;
+	int r;
+
+	kvm__set_thread_name("disk-flush");
+
+	pthread_mutex_lock(&f->lock);
+
+	for (;;) {
+		while (!f->nr && !f->stop)
+			pthread_cond_wait(&f->work, &f->lock);
+
+		/* Flushes still queued when stopping are served first */
+		if (!f->nr)
+			break;
+
+		batch = f->waiting;
+		f->waiting = f->running;
+		f->running = batch;
+		nr = f->nr;
+		f->nr = 0;
+		f->busy = true;
+
+		pthread_mutex_unlock(&f->lock);
+
+		r = disk_flusher__sync(disk);
+
+		/* Each flush is completed on its own, with the shared result */
+		for (i = 0; i < nr; i++)
+			disk->disk_req_cb(batch[i], r);
+		disk_image__end_batch(disk);
+
+		pthread_mutex_lock(&f->lock);
+
+		f->syncs++;
+		f->flushes += nr;
+		f->busy = false;
+		if (!f->nr)
+			pthread_cond_broadcast(&f->idle);
+	}
+
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+/*
+ * Flush the disk from the flusher thread and complete param through
+ * disk_req_cb. Disks without a flusher are flushed right away.
+ */
+void disk_image__flush_async(struct disk_image *disk, void *param)
+{
+	struct disk_flusher *f = disk->flusher;
+
+	if (f) {
+		pthread_mutex_lock(&f->lock);
+		if (f->nr < f->max) {
+			f->waiting[f->nr++] = param;
+			pthread_cond_signal(&f->work);
+			pthread_mutex_unlock(&f->lock);
+			return;
+		}
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	disk->disk_req_cb(param, disk_image__flush(disk));
+}
+
+/* Returns once every flush submitted so far has completed */
+int disk_flusher__wait(struct disk_image *disk)
+{
+	struct disk_flusher *f = disk->flusher;
+	int nr;
+
+	if (!f)
+		return 0;
+
+	pthread_mutex_lock(&f->lock);
+	nr = f->nr + f->busy;
+	while (f->nr || f->busy)
+		pthread_cond_wait(&f->idle, &f->lock);
+	pthread_mutex_unlock(&f->lock);
+
+	return nr;
+}
+
+int disk_flusher__setup(struct disk_image *disk)
+{
+	struct disk_flusher *f;
+	int r;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+
+	/* Every request of every queue may be a flush */
+	f->max = DISK_IO_DEPTH_MAX * (disk->num_queues ? : 1);
+	f->waiting = calloc(f->max, sizeof(*f->waiting));
+	f->running = calloc(f->max, sizeof(*f->running));
+	if (!f->waiting || !f->running) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->work, NULL);
+	pthread_cond_init(&f->idle, NULL);
+
+	disk->flusher = f;
+
+	r = pthread_create(&f->thread, NULL, disk_flusher__thread, disk);
+	if (r) {
+		r = -r;
+		disk->flusher = NULL;
+		goto err_destroy;
+	}
+
+	return 0;
+
+err_destroy:
+	pthread_cond_destroy(&f->idle);
+	pthread_cond_destroy(&f->work);
+	pthread_mutex_destroy(&f->lock);
+err_free:
+	free(f->running);
+	free(f->waiting);
+	free(f);
+	return r;
+}
+
+void disk_flusher__destroy(struct disk_image *disk)
+{
+	struct disk_flusher *f = disk->flusher;
+
+	if (!f)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->stop = true;
+	pthread_cond_signal(&f->work);
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_join(f->thread, NULL);
+
+	pr_info("%llu flushes in %llu syncs",
+		(unsigned long long)f->flushes, (unsigned long long)f->syncs);
+
+	pthread_cond_destroy(&f->idle);
+	pthread_cond_destroy(&f->work);
+	pthread_mutex_destroy(&f->lock);
+	free(f->running);
+	free(f->waiting);
+	free(f);
+
+	disk->flusher = NULL;
+}
@@ -1,6 +1,8 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/falloc.h>
+#include <linux/kernel.h>
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
@@ -61,14 +63,71 @@ int raw_image__close(struct disk_image *disk)
 	return ret;
 }
 
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * A punched hole reads back as zeroes too. Filesystems which can't do
+ * either get the zeroes written out, from a buffer aligned for O_DIRECT.
+ * Ranges which don't start or end on a block go through the bounce path.
+ */
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector,
+			    u64 nr_sectors, bool unmap)
+{
+	static const u8 zeroes[64 << 10]
+		__attribute__((aligned(DISK_BOUNCE_ALIGN)));
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+	int mode = unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+	struct iovec iov;
+	ssize_t r;
+
+	if (fallocate(disk->fd, mode | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+		return 0;
+
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	while (len) {
+		iov.iov_base = (void *)zeroes;
+		iov.iov_len = min_t(u64, len, sizeof(zeroes));
+
+		if (disk->direct &&
+		    !disk_direct__aligned(disk, offset >> SECTOR_SHIFT, &iov, 1)) {
+			r = disk_direct__bounce(disk, true, offset >> SECTOR_SHIFT,
+						&iov, 1);
+			if (r < 0)
+				return r;
+		} else {
+			r = pwrite_in_full(disk->fd, iov.iov_base, iov.iov_len,
+					   offset);
+			if (r < 0)
+				return -errno;
+		}
+
+		offset += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
 /*
  * multiple buffer based disk image operations
  */
 static struct disk_image_operations raw_image_regular_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.wait		= raw_image__wait,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.async		= true,
 };
 
 struct disk_image_operations ro_ops = {
@@ -99,9 +158,31 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 
 		return disk;
 	} else {
+		struct disk_image *disk;
+
 		/*
 		 * Use read/write instead of mmap
 		 */
-		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		if (IS_ERR_OR_NULL(disk))
+			return disk;
+
+		/*
+		 * Partial filesystem blocks go through read-modify-write. Some
+		 * filesystems report huge blocks: only page size ones are
+		 * worth aligning everything on, the rest is a preferred size.
+		 */
+		if (st->st_blksize > SECTOR_SIZE) {
+			disk->phys_block_size = min_t(u32, st->st_blksize, 4096);
+			disk->io_min = disk->phys_block_size;
+			disk->io_opt = st->st_blksize;
+		}
+
+		/* Holes are punched in whole filesystem blocks */
+		disk->discard_max_sectors = DISK_DISCARD_SECTORS_MAX;
+		disk->discard_granularity = max_t(u32, st->st_blksize >> SECTOR_SHIFT, 1);
+		disk->write_zeroes_max_sectors = DISK_DISCARD_SECTORS_MAX;
+
+		return disk;
 	}
 }
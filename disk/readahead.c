@@ -0,0 +1,551 @@
+#include <pthread.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * Sequential stream detection and readahead.
+ *
+ * The disk keeps track of a few streams of reads, each one expecting its
+ * next request where the last one ended. Once a stream proves sequential,
+ * the chunks ahead of it are queued for the readahead threads, which fill
+ * them with the disk's own (blocking) read operation: this works with any
+ * image format. The window of a stream doubles on every sequential read,
+ * and is halved whenever one of its chunks is dropped unused.
+ *
+ * A read is served from memory if every chunk it covers is filled, and
+ * goes to the disk as usual otherwise. Writes invalidate the chunks they
+ * overlap when submitted and again when completed: a chunk being filled
+ * meanwhile is marked stale and dropped, as it may hold the old data.
+ */
+#define DISK_RA_CHUNK		(128U << 10)
+#define DISK_RA_CHUNK_SECTORS	(DISK_RA_CHUNK >> SECTOR_SHIFT)
+#define DISK_RA_STREAMS		8
+#define DISK_RA_THREADS		2
+
+/* Window bounds, in chunks */
+#define DISK_RA_WINDOW_MIN	2
+#define DISK_RA_WINDOW_MAX	32
+
+/* Chunks a read can be served from, bigger ones go to the disk */
+#define DISK_RA_READ_MAX	(DISK_RA_WINDOW_MAX + 1)
+
+enum {
+	DISK_RA_EMPTY,
+	DISK_RA_QUEUED,
+	DISK_RA_READING,
+	DISK_RA_VALID,
+};
+
+/*
+ * Empty chunks are on the free list, queued ones on the queue and filled
+ * ones on the LRU list, unless reads are copying from them (users). All
+ * but the empty ones are hashed by index.
+ */
+struct disk_ra_chunk {
+	struct list_head	list;
+	struct disk_ra_chunk	*hash_next;
+	u64			index;
+	u32			len;
+	u32			users;
+	u8			state;
+	/* Overlapped by a write while being filled or copied from */
+	bool			stale;
+	/* Served a read since it was filled */
+	bool			used;
+	u8			stream;
+};
+
+struct disk_ra_stream {
+	bool			active;
+	/* Sector the next sequential read starts at */
+	u64			next;
+	/* First chunk past the ones queued so far */
+	u64			end;
+	u32			window;
+	u64			stamp;
+};
+
+struct disk_readahead {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	pthread_t		threads[DISK_RA_THREADS];
+	unsigned int		nr_threads;
+	bool			stop;
+
+	void			*data;
+	struct disk_ra_chunk	*chunks;
+	unsigned int		nr_chunks;
+	unsigned int		nr_valid;
+	u32			max_window;
+
+	struct disk_ra_chunk	**hash;
+	u32			hash_mask;
+	struct list_head	free;
+	struct list_head	queue;
+	struct list_head	lru;
+
+	struct disk_ra_stream	streams[DISK_RA_STREAMS];
+	u64			clock;
+
+	u64			hits;
+	u64			misses;
+	u64			filled;
+	u64			wasted;
+};
+
+static struct disk_ra_chunk *disk_ra__find(struct disk_readahead *ra, u64 index)
+{
+	struct disk_ra_chunk *c;
+
+	for (c = ra->hash[index & ra->hash_mask]; c; c = c->hash_next) {
+		if (c->index == index)
+			return c;
+	}
+
+	return NULL;
+}
+
+static void disk_ra__hash(struct disk_readahead *ra, struct disk_ra_chunk *c)
+{
+	struct disk_ra_chunk **head = &ra->hash[c->index & ra->hash_mask];
+
+	c->hash_next = *head;
+	*head = c;
+}
+
+static void disk_ra__unhash(struct disk_readahead *ra, struct disk_ra_chunk *c)
+{
+	struct disk_ra_chunk **p = &ra->hash[c->index & ra->hash_mask];
+
+	while (*p != c)
+		p = &(*p)->hash_next;
+	*p = c->hash_next;
+}
+
+static void *disk_ra__data(struct disk_readahead *ra, struct disk_ra_chunk *c)
+{
+	return ra->data + (size_t)(c - ra->chunks) * DISK_RA_CHUNK;
+}
+
+/* Called with the lock held, the chunk is off its list */
+static void disk_ra__put(struct disk_readahead *ra, struct disk_ra_chunk *c)
+{
+	if (c->state == DISK_RA_VALID)
+		ra->nr_valid--;
+
+	disk_ra__unhash(ra, c);
+	c->state = DISK_RA_EMPTY;
+	list_add(&c->list, &ra->free);
+}
+
+/*
+ * A free chunk, or else the least recently used filled one. Chunks in
+ * flight or being copied from are never taken.
+ */
+static struct disk_ra_chunk *disk_ra__get(struct disk_readahead *ra)
+{
+	struct disk_ra_chunk *c;
+
+	if (list_empty(&ra->free)) {
+		if (list_empty(&ra->lru))
+			return NULL;
+
+		c = list_first_entry(&ra->lru, struct disk_ra_chunk, list);
+		if (!c->used) {
+			ra->wasted++;
+			ra->streams[c->stream].window =
+				max_t(u32, ra->streams[c->stream].window / 2,
+				      DISK_RA_WINDOW_MIN);
+		}
+		list_del(&c->list);
+		disk_ra__put(ra, c);
+	}
+
+	c = list_first_entry(&ra->free, struct disk_ra_chunk, list);
+	list_del(&c->list);
+
+	return c;
+}
+
+/* Queue the chunks up to the window of stream s past 'last' */
+static bool disk_ra__queue(struct disk_readahead *ra, struct disk_image *disk,
+			   struct disk_ra_stream *s, u64 last)
+{
+	u64 nr = DIV_ROUND_UP(disk->size, DISK_RA_CHUNK);
+	u64 index, end = min(last + 1 + s->window, nr);
+	struct disk_ra_chunk *c;
+	bool queued = false;
+
+	for (index = max(s->end, last + 1); index < end; index++) {
+		if (disk_ra__find(ra, index))
+			continue;
+
+		c = disk_ra__get(ra);
+		if (!c)
+			break;
+
+		c->index = index;
+		c->state = DISK_RA_QUEUED;
+		c->stale = false;
+		c->used = false;
+		c->stream = s - ra->streams;
+		disk_ra__hash(ra, c);
+		list_add_tail(&c->list, &ra->queue);
+		queued = true;
+	}
+
+	s->end = max(s->end, index);
+
+	return queued;
+}
+
+/*
+ * Called with the lock held. Sequential reads push their stream's window
+ * forward, the others replace the least recently used stream.
+ */
+static void disk_ra__track(struct disk_readahead *ra, struct disk_image *disk,
+			   u64 sector, u64 nr_sectors, u64 last)
+{
+	struct disk_ra_stream *s, *lru = NULL;
+	unsigned int i;
+
+	for (i = 0; i < DISK_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+
+		/* Tolerate small holes, e.g. requests racing on two queues */
+		if (s->active && sector >= s->next &&
+		    sector < s->next + DISK_RA_CHUNK_SECTORS) {
+			s->next = sector + nr_sectors;
+			s->window = min(s->window * 2, ra->max_window);
+			s->stamp = ra->clock++;
+			if (disk_ra__queue(ra, disk, s, last))
+				pthread_cond_broadcast(&ra->work);
+			return;
+		}
+
+		if (!lru || !s->active || (lru->active && s->stamp < lru->stamp))
+			lru = s;
+	}
+
+	*lru = (struct disk_ra_stream) {
+		.active	= true,
+		.next	= sector + nr_sectors,
+		.end	= last + 1,
+		.window	= DISK_RA_WINDOW_MIN,
+		.stamp	= ra->clock++,
+	};
+}
+
+/* Whether the chunk holds [start, end) of the disk, at least partially */
+static bool disk_ra__covers(struct disk_ra_chunk *c, u64 start, u64 end)
+{
+	u64 base = c->index * DISK_RA_CHUNK;
+
+	return c->state == DISK_RA_VALID && !c->stale &&
+	       min(end, base + DISK_RA_CHUNK) <= base + c->len;
+}
+
+/*
+ * Serve a read from the readahead chunks. Returns the length read, or 0
+ * if the data isn't all there and the read has to go to the disk.
+ *
+ * The chunks are pinned while copying from them, without the lock held:
+ * a write overlapping them meanwhile is concurrent with the read anyway.
+ */
+ssize_t disk_readahead__read(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount)
+{
+	struct disk_ra_chunk *c, *chunks[DISK_RA_READ_MAX];
+	struct disk_readahead *ra = disk->readahead;
+	u64 start = sector << SECTOR_SHIFT;
+	u64 first, last, pos, end;
+	unsigned int i, nr;
+	size_t len = 0, chunk;
+
+	for (i = 0; i < (unsigned int)iovcount; i++)
+		len += iov[i].iov_len;
+	if (!len)
+		return 0;
+
+	end = start + len;
+	first = start / DISK_RA_CHUNK;
+	last = (end - 1) / DISK_RA_CHUNK;
+	nr = min_t(u64, last - first + 1, DISK_RA_READ_MAX + 1);
+
+	pthread_mutex_lock(&ra->lock);
+
+	disk_ra__track(ra, disk, sector, len >> SECTOR_SHIFT, last);
+
+	/* Random reads only pay for the stream tracking */
+	if (nr > DISK_RA_READ_MAX || nr > ra->nr_valid)
+		goto miss;
+
+	for (i = 0; i < nr; i++) {
+		chunks[i] = disk_ra__find(ra, first + i);
+		if (!chunks[i] || !disk_ra__covers(chunks[i], start, end))
+			goto miss;
+	}
+
+	for (i = 0; i < nr; i++) {
+		c = chunks[i];
+		if (!c->users++)
+			list_del(&c->list);
+		c->used = true;
+	}
+
+	ra->hits++;
+
+	pthread_mutex_unlock(&ra->lock);
+
+	for (pos = start, i = 0; pos < end; pos += chunk, i++) {
+		chunk = min(end, (first + i + 1) * DISK_RA_CHUNK) - pos;
+		disk_image__copy_iov(iov, iovcount, pos - start,
+				     disk_ra__data(ra, chunks[i]) +
+				     pos % DISK_RA_CHUNK, chunk, true);
+	}
+
+	pthread_mutex_lock(&ra->lock);
+
+	for (i = 0; i < nr; i++) {
+		c = chunks[i];
+		if (--c->users)
+			continue;
+
+		if (c->stale)
+			disk_ra__put(ra, c);
+		else
+			list_add_tail(&c->list, &ra->lru);
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+
+	return len;
+
+miss:
+	ra->misses++;
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+/* Called with the lock held */
+static void disk_ra__invalidate(struct disk_readahead *ra,
+				struct disk_ra_chunk *c)
+{
+	/* Not a misprediction, the stream is left alone */
+	switch (c->state) {
+	case DISK_RA_QUEUED:
+		list_del(&c->list);
+		disk_ra__put(ra, c);
+		break;
+	case DISK_RA_READING:
+		c->stale = true;
+		break;
+	case DISK_RA_VALID:
+		if (c->users) {
+			c->stale = true;
+		} else {
+			list_del(&c->list);
+			disk_ra__put(ra, c);
+		}
+		break;
+	}
+}
+
+/* Drop whatever overlaps sectors [sector, sector + nr_sectors) */
+void disk_readahead__invalidate(struct disk_image *disk, u64 sector,
+				u64 nr_sectors)
+{
+	struct disk_readahead *ra = disk->readahead;
+	struct disk_ra_chunk *c;
+	u64 first, last, index;
+	unsigned int i;
+
+	if (!nr_sectors)
+		return;
+
+	first = sector / DISK_RA_CHUNK_SECTORS;
+	last = (sector + nr_sectors - 1) / DISK_RA_CHUNK_SECTORS;
+
+	pthread_mutex_lock(&ra->lock);
+
+	/* Big discards are cheaper to check against every chunk */
+	if (last - first < ra->nr_chunks) {
+		for (index = first; index <= last; index++) {
+			c = disk_ra__find(ra, index);
+			if (c)
+				disk_ra__invalidate(ra, c);
+		}
+	} else {
+		for (i = 0; i < ra->nr_chunks; i++) {
+			c = &ra->chunks[i];
+			if (c->state != DISK_RA_EMPTY &&
+			    c->index >= first && c->index <= last)
+				disk_ra__invalidate(ra, c);
+		}
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void *disk_ra__thread(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_readahead *ra = disk->readahead;
+	struct disk_ra_chunk *c;
+	struct iovec iov;
+	u64 offset;
+	u32 len;
+	ssize_t r;
+
+	kvm__set_thread_name("disk-readahead");
+
+	pthread_mutex_lock(&ra->lock);
+
+	for (;;) {
+		while (list_empty(&ra->queue) && !ra->stop)
+			pthread_cond_wait(&ra->work, &ra->lock);
+
+		if (ra->stop)
+			break;
+
+		/* Oldest queued chunk first */
+		c = list_first_entry(&ra->queue, struct disk_ra_chunk, list);
+		list_del(&c->list);
+		c->state = DISK_RA_READING;
+		offset = c->index * DISK_RA_CHUNK;
+		len = min_t(u64, DISK_RA_CHUNK, disk->size - offset);
+
+		pthread_mutex_unlock(&ra->lock);
+
+		/* O_DIRECT reads whole blocks, the tail of the disk included */
+		iov.iov_base = disk_ra__data(ra, c);
+		iov.iov_len = disk->direct ? ALIGN(len, disk->dio_align) : len;
+		r = disk->ops->read(disk, offset >> SECTOR_SHIFT, &iov, 1, NULL);
+
+		pthread_mutex_lock(&ra->lock);
+
+		if (c->stale || r < (ssize_t)len) {
+			disk_ra__put(ra, c);
+			continue;
+		}
+
+		c->len = len;
+		c->state = DISK_RA_VALID;
+		list_add_tail(&c->list, &ra->lru);
+		ra->nr_valid++;
+		ra->filled++;
+	}
+
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+static void disk_ra__free(struct disk_readahead *ra)
+{
+	pthread_cond_destroy(&ra->work);
+	pthread_mutex_destroy(&ra->lock);
+	munmap(ra->data, (size_t)ra->nr_chunks * DISK_RA_CHUNK);
+	free(ra->hash);
+	free(ra->chunks);
+	free(ra);
+}
+
+/* Read ahead of sequential streams into a cache of up to size_kb */
+int disk_readahead__setup(struct disk_image *disk, u32 size_kb)
+{
+	struct disk_readahead *ra;
+	unsigned int i;
+	int r = 0;
+
+	if (!disk->ops->read)
+		return -EOPNOTSUPP;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return -ENOMEM;
+
+	/* At least a minimal window for two streams */
+	ra->nr_chunks = max_t(u32, ((u64)size_kb << 10) / DISK_RA_CHUNK,
+			      DISK_RA_WINDOW_MIN * 2);
+	ra->max_window = min_t(u32, ra->nr_chunks / 2, DISK_RA_WINDOW_MAX);
+
+	/* Twice as many buckets as chunks */
+	ra->hash_mask = roundup_pow_of_two(ra->nr_chunks * 2) - 1;
+
+	ra->chunks = calloc(ra->nr_chunks, sizeof(*ra->chunks));
+	ra->hash = calloc(ra->hash_mask + 1, sizeof(*ra->hash));
+	ra->data = mmap(NULL, (size_t)ra->nr_chunks * DISK_RA_CHUNK, PROT_RW,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (!ra->chunks || !ra->hash || ra->data == MAP_FAILED) {
+		if (ra->data != MAP_FAILED)
+			munmap(ra->data, (size_t)ra->nr_chunks * DISK_RA_CHUNK);
+		free(ra->hash);
+		free(ra->chunks);
+		free(ra);
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&ra->free);
+	INIT_LIST_HEAD(&ra->queue);
+	INIT_LIST_HEAD(&ra->lru);
+	for (i = 0; i < ra->nr_chunks; i++)
+		list_add_tail(&ra->chunks[i].list, &ra->free);
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->work, NULL);
+
+	disk->readahead = ra;
+
+	for (i = 0; i < DISK_RA_THREADS; i++) {
+		r = pthread_create(&ra->threads[i], NULL, disk_ra__thread, disk);
+		if (r)
+			break;
+		ra->nr_threads++;
+	}
+
+	if (!ra->nr_threads) {
+		disk->readahead = NULL;
+		disk_ra__free(ra);
+		return -r;
+	}
+
+	pr_info("reading ahead into %u KiB", ra->nr_chunks * (DISK_RA_CHUNK >> 10));
+
+	return 0;
+}
+
+void disk_readahead__destroy(struct disk_image *disk)
+{
+	struct disk_readahead *ra = disk->readahead;
+	unsigned int i;
+
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->work);
+	pthread_mutex_unlock(&ra->lock);
+
+	for (i = 0; i < ra->nr_threads; i++)
+		pthread_join(ra->threads[i], NULL);
+
+	/* What is still there was read for nothing */
+	for (i = 0; i < ra->nr_chunks; i++) {
+		if (ra->chunks[i].state == DISK_RA_VALID && !ra->chunks[i].used)
+			ra->wasted++;
+	}
+
+	pr_info("readahead: %llu hits %llu misses, %llu chunks read %llu wasted",
+		(unsigned long long)ra->hits, (unsigned long long)ra->misses,
+		(unsigned long long)ra->filled, (unsigned long long)ra->wasted);
+
+	disk_ra__free(ra);
+
+	disk->readahead = NULL;
+}
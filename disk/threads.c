@@ -0,0 +1,288 @@
+#include <pthread.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * Runs the disk's own (blocking) read and write operations on a pool of
+ * worker threads, so that any image format gets more than one request in
+ * flight without a kernel asynchronous interface.
+ *
+ * Requests queued while the disk is plugged wait for the unplug to wake
+ * the workers up. A worker only ends the completion batch once it finds
+ * the queue empty, the batch callback is then called by the last one to
+ * run out of work.
+ */
+#define DISK_THREADS_MAX	64
+
+struct disk_thread_job {
+	struct list_head	list;
+	bool			write;
+	u64			sector;
+	const struct iovec	*iov;
+	int			iovcount;
+	void			*param;
+};
+
+struct disk_threads {
+	pthread_t		*threads;
+	unsigned int		nr_threads;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	pthread_cond_t		room;
+	pthread_cond_t		idle;
+	struct list_head	queue;
+	struct list_head	free;
+	struct disk_thread_job	*jobs;
+	u64			inflight;
+	bool			stop;
+};
+
+static ssize_t threads_do_job(struct disk_image *disk, struct disk_thread_job *job)
+{
+	ssize_t r;
+	int err;
+
+	if (!job->write)
+		return disk->ops->read(disk, job->sector, job->iov,
+				       job->iovcount, job->param);
+
+	if (!disk->ops->write)
+		return -EROFS;
+
+	r = disk->ops->write(disk, job->sector, job->iov, job->iovcount,
+			     job->param);
+	if (r >= 0 && disk_image__writethrough(disk)) {
+		err = disk_image__flush(disk);
+		if (err < 0)
+			r = err;
+	}
+
+	return r;
+}
+
+static void *threads_worker(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_threads *t = disk->engine_priv;
+	struct disk_thread_job *job;
+	void *param;
+	ssize_t r;
+	bool last;
+
+	kvm__set_thread_name("disk-thread-io");
+
+	pthread_mutex_lock(&t->lock);
+
+	for (;;) {
+		while (list_empty(&t->queue) && !t->stop)
+			pthread_cond_wait(&t->work, &t->lock);
+
+		if (list_empty(&t->queue))
+			break;
+
+		job = list_first_entry(&t->queue, struct disk_thread_job, list);
+		list_del(&job->list);
+
+		pthread_mutex_unlock(&t->lock);
+
+		r = threads_do_job(disk, job);
+		if (r < 0)
+			pr_info("disk thread I/O error: %ld", (long)r);
+
+		param = job->param;
+
+		pthread_mutex_lock(&t->lock);
+		list_add(&job->list, &t->free);
+		pthread_cond_signal(&t->room);
+		last = list_empty(&t->queue);
+		pthread_mutex_unlock(&t->lock);
+
+		disk->disk_req_cb(param, r);
+		if (last)
+			disk_image__end_batch(disk);
+
+		pthread_mutex_lock(&t->lock);
+		if (--t->inflight == 0)
+			pthread_cond_broadcast(&t->idle);
+	}
+
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+static ssize_t threads_queue_rw(struct disk_image *disk, bool write, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_threads *t = disk->engine_priv;
+	struct disk_thread_job *job;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	pthread_mutex_lock(&t->lock);
+
+	while (list_empty(&t->free)) {
+		/* Don't wait on requests we are sitting on */
+		pthread_cond_broadcast(&t->work);
+		pthread_cond_wait(&t->room, &t->lock);
+	}
+
+	job = list_first_entry(&t->free, struct disk_thread_job, list);
+	list_del(&job->list);
+
+	job->write = write;
+	job->sector = sector;
+	job->iov = iov;
+	job->iovcount = iovcount;
+	job->param = param;
+	list_add_tail(&job->list, &t->queue);
+	t->inflight++;
+
+	if (!disk_image__plugged())
+		pthread_cond_signal(&t->work);
+
+	pthread_mutex_unlock(&t->lock);
+
+	return len;
+}
+
+static ssize_t threads_read(struct disk_image *disk, u64 sector,
+			    const struct iovec *iov, int iovcount, void *param)
+{
+	return threads_queue_rw(disk, false, sector, iov, iovcount, param);
+}
+
+static ssize_t threads_write(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount, void *param)
+{
+	return threads_queue_rw(disk, true, sector, iov, iovcount, param);
+}
+
+static void threads_unplug(struct disk_image *disk)
+{
+	struct disk_threads *t = disk->engine_priv;
+
+	pthread_mutex_lock(&t->lock);
+	if (!list_empty(&t->queue))
+		pthread_cond_broadcast(&t->work);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static int threads_wait(struct disk_image *disk)
+{
+	struct disk_threads *t = disk->engine_priv;
+	u64 inflight;
+
+	pthread_mutex_lock(&t->lock);
+	inflight = t->inflight;
+	pthread_cond_broadcast(&t->work);
+	while (t->inflight)
+		pthread_cond_wait(&t->idle, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+
+	return inflight;
+}
+
+static void threads_stop(struct disk_threads *t)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&t->lock);
+	t->stop = true;
+	pthread_cond_broadcast(&t->work);
+	pthread_mutex_unlock(&t->lock);
+
+	for (i = 0; i < t->nr_threads; i++)
+		pthread_join(t->threads[i], NULL);
+}
+
+static void threads_free(struct disk_threads *t)
+{
+	pthread_cond_destroy(&t->idle);
+	pthread_cond_destroy(&t->room);
+	pthread_cond_destroy(&t->work);
+	pthread_mutex_destroy(&t->lock);
+	free(t->threads);
+	free(t->jobs);
+	free(t);
+}
+
+static int threads_setup(struct disk_image *disk)
+{
+	struct disk_threads *t;
+	unsigned int i, nr_jobs;
+	int r;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	/* Room for every request of every queue */
+	nr_jobs = DISK_IO_DEPTH_MAX * (disk->num_queues ? : 1);
+	t->jobs = calloc(nr_jobs, sizeof(*t->jobs));
+	t->threads = calloc(DISK_THREADS_MAX, sizeof(*t->threads));
+	if (!t->jobs || !t->threads) {
+		free(t->threads);
+		free(t->jobs);
+		free(t);
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&t->queue);
+	INIT_LIST_HEAD(&t->free);
+	for (i = 0; i < nr_jobs; i++)
+		list_add_tail(&t->jobs[i].list, &t->free);
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->work, NULL);
+	pthread_cond_init(&t->room, NULL);
+	pthread_cond_init(&t->idle, NULL);
+
+	disk->engine_priv = t;
+
+	for (i = 0; i < min_t(unsigned int, disk->io_threads ? : DISK_IO_THREADS_DEFAULT,
+			      DISK_THREADS_MAX); i++) {
+		r = pthread_create(&t->threads[i], NULL, threads_worker, disk);
+		if (r)
+			break;
+		t->nr_threads++;
+	}
+
+	if (!t->nr_threads) {
+		disk->engine_priv = NULL;
+		threads_free(t);
+		return -r;
+	}
+
+	return 0;
+}
+
+static void threads_destroy(struct disk_image *disk)
+{
+	struct disk_threads *t = disk->engine_priv;
+
+	threads_wait(disk);
+	threads_stop(t);
+	threads_free(t);
+
+	disk->engine_priv = NULL;
+}
+
+const struct disk_io_engine disk_threads_engine = {
+	.name		= "threads",
+	.any_format	= true,
+	.setup		= threads_setup,
+	.destroy	= threads_destroy,
+	.read		= threads_read,
+	.write		= threads_write,
+	.unplug		= threads_unplug,
+	.wait		= threads_wait,
+};
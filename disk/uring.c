@@ -0,0 +1,317 @@
+#include <liburing.h>
+#include <pthread.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+/*
+ * Every virtqueue of the disk submits to the same ring, under sq_lock.
+ * Completions are reaped by a single thread which calls disk_req_cb.
+ */
+#define URING_IOPOLL_WAIT_MS	100
+#define URING_ROOM_WAIT_MS	10
+
+struct disk_uring {
+	struct io_uring		ring;
+	pthread_mutex_t		sq_lock;
+	pthread_cond_t		room;
+	unsigned int		queued;
+
+	pthread_t		reaper;
+	bool			stop;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		idle;
+	u64			inflight;
+};
+
+/*
+ * Called with sq_lock held. If the kernel can't take the entries right
+ * now (e.g. -EBUSY on CQ overflow) they stay queued and the reaper
+ * retries once it has made room.
+ */
+static void uring_submit(struct disk_uring *u)
+{
+	if (u->queued && io_uring_submit(&u->ring) >= 0)
+		u->queued = 0;
+}
+
+/*
+ * Called with sq_lock held. The ring has room for every request, but
+ * requests split for max_sectors take more than one entry: if the kernel
+ * can't take what fills the SQ, wait for the reaper to make room, as the
+ * aio engine does. The wait is bounded in case nothing is in flight to
+ * complete.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct disk_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct timespec ts;
+
+	while (!(sqe = io_uring_get_sqe(&u->ring))) {
+		/* The SQ is full of plugged requests, push them out */
+		uring_submit(u);
+		sqe = io_uring_get_sqe(&u->ring);
+		if (sqe || u->stop)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += URING_ROOM_WAIT_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&u->room, &u->sq_lock, &ts);
+	}
+
+	return sqe;
+}
+
+static ssize_t uring_queue_rw(struct disk_image *disk, bool write, u64 sector,
+			      const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_uring *u = disk->engine_priv;
+	struct io_uring_sqe *sqe;
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t len = 0;
+	int i, r = 0;
+
+	if (write && disk->readonly)
+		return -EROFS;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	pthread_mutex_lock(&u->lock);
+	u->inflight++;
+	pthread_mutex_unlock(&u->lock);
+
+	pthread_mutex_lock(&u->sq_lock);
+
+	/* Only fails once the engine is going away */
+	sqe = uring_get_sqe(u);
+	if (!sqe) {
+		r = -EBUSY;
+		goto out;
+	}
+
+	/* The disk fd is registered as fixed file 0 */
+	if (write)
+		io_uring_prep_writev2(sqe, 0, iov, iovcount, offset,
+				      disk_image__writethrough(disk) ? RWF_DSYNC : 0);
+	else
+		io_uring_prep_readv(sqe, 0, iov, iovcount, offset);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, param);
+	u->queued++;
+
+	if (!disk_image__plugged())
+		uring_submit(u);
+
+out:
+	pthread_mutex_unlock(&u->sq_lock);
+
+	if (r < 0) {
+		pthread_mutex_lock(&u->lock);
+		if (--u->inflight == 0)
+			pthread_cond_broadcast(&u->idle);
+		pthread_mutex_unlock(&u->lock);
+		return r;
+	}
+
+	return len;
+}
+
+static ssize_t uring_read(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_queue_rw(disk, false, sector, iov, iovcount, param);
+}
+
+static ssize_t uring_write(struct disk_image *disk, u64 sector,
+			   const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_queue_rw(disk, true, sector, iov, iovcount, param);
+}
+
+static void uring_unplug(struct disk_image *disk)
+{
+	struct disk_uring *u = disk->engine_priv;
+
+	pthread_mutex_lock(&u->sq_lock);
+	uring_submit(u);
+	pthread_mutex_unlock(&u->sq_lock);
+}
+
+static int uring_wait(struct disk_image *disk)
+{
+	struct disk_uring *u = disk->engine_priv;
+	u64 inflight;
+
+	uring_unplug(disk);
+
+	pthread_mutex_lock(&u->lock);
+	inflight = u->inflight;
+	while (u->inflight)
+		pthread_cond_wait(&u->idle, &u->lock);
+	pthread_mutex_unlock(&u->lock);
+
+	return inflight;
+}
+
+static void *uring_reaper(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_uring *u = disk->engine_priv;
+	struct __kernel_timespec ts = {
+		.tv_nsec = URING_IOPOLL_WAIT_MS * 1000000,
+	};
+	struct io_uring_cqe *cqe;
+	unsigned int nr;
+	void *param;
+	int r, res;
+
+	kvm__set_thread_name("disk-uring-io");
+
+	while (!u->stop) {
+		/* IOPOLL rings can't take a NOP to wake us up, poll the flag */
+		if (disk->io_flags & DISK_IO_IOPOLL)
+			r = io_uring_wait_cqe_timeout(&u->ring, &cqe, &ts);
+		else
+			r = io_uring_wait_cqe(&u->ring, &cqe);
+		if (r < 0)
+			continue;
+
+		nr = 0;
+		do {
+			param = io_uring_cqe_get_data(cqe);
+			res = cqe->res;
+			io_uring_cqe_seen(&u->ring, cqe);
+
+			/* A NULL param is the wake up from uring_destroy() */
+			if (!param)
+				continue;
+
+			disk->disk_req_cb(param, res);
+			nr++;
+		} while (io_uring_peek_cqe(&u->ring, &cqe) == 0);
+
+		if (nr) {
+			disk_image__end_batch(disk);
+
+			pthread_mutex_lock(&u->lock);
+			u->inflight -= nr;
+			if (u->inflight == 0)
+				pthread_cond_broadcast(&u->idle);
+			pthread_mutex_unlock(&u->lock);
+		}
+
+		pthread_mutex_lock(&u->sq_lock);
+		uring_submit(u);
+		pthread_cond_broadcast(&u->room);
+		pthread_mutex_unlock(&u->sq_lock);
+	}
+
+	return NULL;
+}
+
+static int uring_setup(struct disk_image *disk)
+{
+	struct io_uring_params params = { 0 };
+	struct disk_uring *u;
+	unsigned int entries;
+	int r;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	/* Room for every request of every queue, see uring_get_sqe() */
+	entries = DISK_IO_DEPTH_MAX * (disk->num_queues ? : 1);
+
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 2;
+	if (disk->io_flags & DISK_IO_SQPOLL) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;
+	}
+	/* Polled completions are only for O_DIRECT, everything else fails */
+	if ((disk->io_flags & DISK_IO_IOPOLL) && !disk->direct) {
+		pr_warning("io-iopoll needs O_DIRECT, ignoring it");
+		disk->io_flags &= ~DISK_IO_IOPOLL;
+	}
+	if (disk->io_flags & DISK_IO_IOPOLL)
+		params.flags |= IORING_SETUP_IOPOLL;
+
+	r = io_uring_queue_init_params(entries, &u->ring, &params);
+	if (r < 0)
+		goto err_free;
+
+	r = io_uring_register_files(&u->ring, &disk->fd, 1);
+	if (r < 0)
+		goto err_exit;
+
+	pthread_mutex_init(&u->sq_lock, NULL);
+	pthread_cond_init(&u->room, NULL);
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->idle, NULL);
+
+	disk->engine_priv = u;
+
+	r = pthread_create(&u->reaper, NULL, uring_reaper, disk);
+	if (r) {
+		r = -r;
+		disk->engine_priv = NULL;
+		goto err_exit;
+	}
+
+	return 0;
+
+err_exit:
+	io_uring_queue_exit(&u->ring);
+err_free:
+	free(u);
+	return r;
+}
+
+static void uring_destroy(struct disk_image *disk)
+{
+	struct disk_uring *u = disk->engine_priv;
+	struct io_uring_sqe *sqe;
+
+	uring_wait(disk);
+
+	u->stop = true;
+
+	if (!(disk->io_flags & DISK_IO_IOPOLL)) {
+		pthread_mutex_lock(&u->sq_lock);
+		sqe = uring_get_sqe(u);
+		if (sqe) {
+			io_uring_prep_nop(sqe);
+			io_uring_sqe_set_data(sqe, NULL);
+			io_uring_submit(&u->ring);
+		}
+		pthread_mutex_unlock(&u->sq_lock);
+	}
+
+	pthread_join(u->reaper, NULL);
+
+	io_uring_queue_exit(&u->ring);
+	pthread_cond_destroy(&u->idle);
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->room);
+	pthread_mutex_destroy(&u->sq_lock);
+	free(u);
+
+	disk->engine_priv = NULL;
+}
+
+const struct disk_io_engine disk_uring_engine = {
+	.name		= "io_uring",
+	.setup		= uring_setup,
+	.destroy	= uring_destroy,
+	.read		= uring_read,
+	.write		= uring_write,
+	.unplug		= uring_unplug,
+	.wait		= uring_wait,
+};
@@ -17,10 +17,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-
-#ifdef CONFIG_HAS_AIO
-#include <libaio.h>
-#endif
+#include <sched.h>
 
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1UL << SECTOR_SHIFT)
@@ -32,9 +29,62 @@ enum {
 
 #define MAX_DISK_IMAGES         4
 
+/* Requests a single virtqueue can have in flight */
+#define DISK_IO_DEPTH_MAX	1024
+
+/* Workers of the "threads" I/O engine, unless configured */
+#define DISK_IO_THREADS_DEFAULT	4
+
+/* Most iovs preadv() and io_submit() take per request (UIO_MAXIOV) */
+#define DISK_IOV_MAX		1024
+
+/* O_DIRECT bounce buffers, see disk/direct.c */
+#define DISK_BOUNCE_SIZE	(1U << 20)
+#define DISK_BOUNCE_ALIGN	4096
+
+/* Largest discard or write zeroes range handed to a file in one call */
+#define DISK_DISCARD_SECTORS_MAX	(1U << 21)
+
+struct disk_bounce_pool;
+struct disk_flusher;
 struct disk_image;
+struct disk_readahead;
 struct kvm;
 
+/*
+ * How requests reach the host, instead of the disk operations. Engines
+ * are asynchronous: they complete requests through disk_req_cb.
+ */
+struct disk_io_engine {
+	const char *name;
+	/* Runs the disk's own operations, so works with any image format */
+	bool any_format;
+	int (*setup)(struct disk_image *disk);
+	void (*destroy)(struct disk_image *disk);
+	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			int iovcount, void *param);
+	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			int iovcount, void *param);
+	/* Submit whatever was queued while the caller was plugged */
+	void (*unplug)(struct disk_image *disk);
+	int (*wait)(struct disk_image *disk);
+};
+
+/*
+ * Host cache handling. Writeback completes writes once they reach the
+ * host's cache and syncs on flush, writethrough syncs every write and
+ * unsafe never syncs at all (for scratch disks).
+ */
+enum disk_cache_mode {
+	DISK_CACHE_WRITEBACK,
+	DISK_CACHE_WRITETHROUGH,
+	DISK_CACHE_UNSAFE,
+};
+
+/* disk_image_params.io_flags */
+#define DISK_IO_SQPOLL		(1U << 0)	/* Kernel side submission thread */
+#define DISK_IO_IOPOLL		(1U << 1)	/* Busy poll for completions (O_DIRECT) */
+
 struct disk_image_operations {
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
@@ -43,6 +93,10 @@ struct disk_image_operations {
 	int (*flush)(struct disk_image *disk);
 	int (*wait)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
+	/* Synchronous, return 0 or -errno (-EOPNOTSUPP if not supported) */
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors);
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap);
 	bool async;
 };
 
@@ -56,9 +110,36 @@ struct disk_image_params {
 	const char *tpgt;
 	bool readonly;
 	bool direct;
+	enum disk_cache_mode cache_mode;
 
 	u32 addr;
 	u32 irq;
+
+	/* Number of virtqueues, and the host CPUs to run their workers on */
+	u16 num_queues;
+	cpu_set_t cpus;
+
+	/* NULL (or "sync") for synchronous I/O from the virtqueue thread */
+	const char *io_engine;
+	unsigned int io_flags;
+	/* Workers of the "threads" engine, 0 for the default */
+	u16 io_threads;
+
+	/*
+	 * Interrupt coalescing: hold the interrupt for up to irq_coalesce_usecs
+	 * unless irq_coalesce_count completions are pending. 0 usecs disables.
+	 */
+	u32 irq_coalesce_count;
+	u32 irq_coalesce_usecs;
+
+	/*
+	 * Keep polling the virtqueues, with guest notifications suppressed,
+	 * for up to poll_usecs after the last activity. 0 disables.
+	 */
+	u32 poll_usecs;
+
+	/* Read ahead of sequential streams into up to readahead_kb. 0 disables */
+	u32 readahead_kb;
 };
 
 struct disk_image {
@@ -68,20 +149,74 @@ struct disk_image {
 	void				*priv;
 	void				*disk_req_cb_param;
 	void				(*disk_req_cb)(void *param, long len);
+	/* Called once a batch of disk_req_cb calls is over */
+	void				(*disk_req_batch_cb)(void *param);
 	bool				readonly;
 	bool				async;
-#ifdef CONFIG_HAS_AIO
-	io_context_t			ctx;
-	int				evt;
-	pthread_t			thread;
-	u64				aio_inflight;
-#endif /* CONFIG_HAS_AIO */
 	const char			*wwpn;
 	const char			*tpgt;
 	int				debug_iodelay;
 
 	u32 addr;
 	u32 irq;
+
+	u16 num_queues;
+	cpu_set_t cpus;
+
+	const struct disk_io_engine	*engine;
+	void				*engine_priv;
+	unsigned int			io_flags;
+	u16				io_threads;
+
+	/* Background flushes, see disk/flush.c */
+	struct disk_flusher		*flusher;
+
+	/* Sequential readahead, see disk/readahead.c */
+	struct disk_readahead		*readahead;
+
+	/*
+	 * The configured cache mode, and whether writes currently have to
+	 * be synced, which the guest may change at runtime.
+	 */
+	enum disk_cache_mode		cache_mode;
+	bool				writethrough;
+
+	/*
+	 * Opened with O_DIRECT: offsets and lengths must be multiples of
+	 * dio_align and buffers aligned on dio_mem_align, or be bounced.
+	 */
+	bool				direct;
+	u32				dio_align;
+	u32				dio_mem_align;
+	struct disk_bounce_pool		*bounce;
+	/* Whether guest buffers can be pinned, see disk_direct__sync() */
+	u8				dio_pin;
+
+	/*
+	 * Limits of a single read or write submission: bigger requests are
+	 * better split by the caller. max_sectors is 0 if unlimited.
+	 */
+	u32				max_sectors;
+	u16				max_segments;
+
+	/*
+	 * Topology, in bytes: requests aligned on phys_block_size never make
+	 * the host read-modify-write, io_opt is the preferred request size.
+	 */
+	u32				blk_size;
+	u32				phys_block_size;
+	u32				align_offset;
+	u32				io_min;
+	u32				io_opt;
+
+	/* Discard and write zeroes limits, in sectors. 0 if unsupported */
+	u32				discard_max_sectors;
+	u32				discard_granularity;
+	u32				write_zeroes_max_sectors;
+
+	u32 irq_coalesce_count;
+	u32 irq_coalesce_usecs;
+	u32 poll_usecs;
 };
 
 #if 0
@@ -91,12 +226,22 @@ int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
 int disk_image__flush(struct disk_image *disk);
+void disk_image__set_writeback(struct disk_image *disk, bool writeback);
+void disk_image__flush_async(struct disk_image *disk, void *param);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap);
 int disk_image__wait(struct disk_image *disk);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len);
+int disk_image__set_engine(struct disk_image *disk, const char *name,
+			   unsigned int flags);
+void disk_image__plug(struct disk_image *disk);
+void disk_image__unplug(struct disk_image *disk);
+bool disk_image__plugged(void);
 
 struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
@@ -110,36 +255,57 @@ ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector,
 ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 int raw_image__close(struct disk_image *disk);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector,
+			    u64 nr_sectors, bool unmap);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_req_batch_cb)(void *param),
+				    void *param);
+void disk_image__end_batch(struct disk_image *disk);
+void disk_image__copy_iov(const struct iovec *iov, int iovcount, size_t off,
+			  void *buf, size_t len, bool to_iov);
 
-#ifdef CONFIG_HAS_AIO
-int disk_aio_setup(struct disk_image *disk);
-void disk_aio_destroy(struct disk_image *disk);
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount, void *param);
-int raw_image__wait(struct disk_image *disk);
+int disk_direct__setup(struct disk_image *disk);
+void disk_direct__destroy(struct disk_image *disk);
+bool disk_direct__aligned(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount);
+bool disk_direct__sync(struct disk_image *disk, bool write, u64 sector,
+		       const struct iovec *iov, int iovcount, ssize_t *total);
+ssize_t disk_direct__bounce(struct disk_image *disk, bool write, u64 sector,
+			    const struct iovec *iov, int iovcount);
 
-#define raw_image__read		raw_image__read_async
-#define raw_image__write	raw_image__write_async
+int disk_flusher__setup(struct disk_image *disk);
+void disk_flusher__destroy(struct disk_image *disk);
+int disk_flusher__wait(struct disk_image *disk);
 
-#else /* !CONFIG_HAS_AIO */
-static inline int disk_aio_setup(struct disk_image *disk)
-{
-	/* No-op */
-	return 0;
-}
-static inline void disk_aio_destroy(struct disk_image *disk)
+int disk_readahead__setup(struct disk_image *disk, u32 size_kb);
+void disk_readahead__destroy(struct disk_image *disk);
+ssize_t disk_readahead__read(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount);
+void disk_readahead__invalidate(struct disk_image *disk, u64 sector,
+				u64 nr_sectors);
+
+extern const struct disk_io_engine disk_threads_engine;
+#ifdef CONFIG_HAS_AIO
+extern const struct disk_io_engine disk_aio_engine;
+#endif
+#ifdef CONFIG_HAS_IO_URING
+extern const struct disk_io_engine disk_uring_engine;
+#endif
+
+/* Writes must be on stable storage before they complete */
+static inline bool disk_image__writethrough(struct disk_image *disk)
 {
+	return __atomic_load_n(&disk->writethrough, __ATOMIC_RELAXED);
 }
 
+/* Asynchronous I/O goes through disk_image.engine instead */
 static inline int raw_image__wait(struct disk_image *disk)
 {
 	return 0;
 }
 #define raw_image__read		raw_image__read_sync
 #define raw_image__write	raw_image__write_sync
-#endif /* CONFIG_HAS_AIO */
 
 #endif /* KVM__DISK_IMAGE_H */
@@ -4,6 +4,8 @@
 #include <linux/types.h>
 #include <linux/virtio_mmio.h>
 #include "kvm/virtio.h"
+#include "kvm/mutex.h"
+#include "kvm/rwsem.h"
 
 #define VIRTIO_MMIO_MAX_VQ	32
 #define VIRTIO_MMIO_MAX_CONFIG	1
@@ -59,6 +61,19 @@ struct virtio_mmio {
 	void			*dev;
 	struct kvm		*kvm;
 	u32			irq;
+	/*
+	 * Serializes register accesses from concurrent ioreq threads. Queue
+	 * notifies only take it for reading: they run concurrently, but
+	 * never with a reset tearing the queues down.
+	 */
+	pthread_rwlock_t	lock;
+	/*
+	 * Serializes interrupt_state updates with the irq level hypercalls,
+	 * so the line follows interrupt_state: high iff it is non-zero.
+	 */
+	struct mutex		irq_lock;
+	u64			irq_issued;
+	u64			irq_suppressed;
 	struct virtio_mmio_hdr	hdr;
 #if 0
 	struct virtio_mmio_ioevent_param ioeventfds[VIRTIO_MMIO_MAX_VQ];
@@ -67,6 +82,8 @@ struct virtio_mmio {
 
 int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
 int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev);
+int virtio_mmio_needs_reset(struct kvm *kvm, struct virtio_device *vdev);
+void virtio_mmio_irq_ack(struct virtio_mmio *vmmio, u32 val);
 int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_reset(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
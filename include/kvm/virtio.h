@@ -14,6 +14,8 @@
 
 #include "kvm/kvm.h"
 
+struct demu_iov_mapping;
+
 #define VIRTIO_IRQ_LOW		0
 #define VIRTIO_IRQ_HIGH		1
 
@@ -67,6 +69,34 @@ struct vring_addr {
 	};
 };
 
+/*
+ * Packed ring (VIRTIO_F_RING_PACKED) state. The driver and device areas
+ * only hold the event suppression structures. Used descriptors are
+ * written over the consumed ones, each buffer taking as many slots as
+ * its chain did, so the chain of each buffer id is remembered.
+ */
+struct vring_packed {
+	struct vring_packed_desc	*desc;
+	struct vring_packed_desc_event	*driver;
+	struct vring_packed_desc_event	*device;
+	bool				avail_wrap;
+	bool				used_wrap;
+	u16				used_idx;
+	/* Where the next used descriptor of the current batch goes */
+	u16				batch_idx;
+	bool				batch_wrap;
+	u16				signalled_used;
+	bool				signalled_used_valid;
+	/* Ring position and length of the chain, by buffer id */
+	u16				*chain_head;
+	u16				*chain_len;
+	/*
+	 * Length of the chain each used descriptor stands for, by ring
+	 * position: the driver may have rewritten the id by then.
+	 */
+	u16				*used_len;
+};
+
 struct virt_queue {
 	struct vring	vring;
 	struct vring_addr vring_addr;
@@ -77,6 +107,22 @@ struct virt_queue {
 	u16		endian;
 	bool		use_event_idx;
 	bool		enabled;
+	/* The device polls the ring, see virt_queue__disable_notify() */
+	bool		no_notify;
+	/*
+	 * With a packed ring, only vring.num is used out of vring and
+	 * last_avail_idx is the position of the next descriptor to consume.
+	 */
+	bool		packed;
+	struct vring_packed vring_packed;
+	/* Longest chain the device takes, vring.num if 0 */
+	u16		iov_max;
+	/*
+	 * The driver handed over a buffer id out of the ring, or a chain
+	 * which can't be walked: nothing more is taken from the queue until
+	 * the device is reset.
+	 */
+	bool		broken;
 };
 
 /*
@@ -138,10 +184,16 @@ static inline __u64 __virtio_h2g_u64(u16 endian, __u64 val)
 
 #endif
 
+u16 virt_queue__pop_packed(struct virt_queue *vq);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
 	__u16 guest_idx;
 
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	/*
 	 * The guest updates the avail index after writing the ring entry.
 	 * Ensure that we read the updated entry once virt_queue__available()
@@ -150,7 +202,14 @@ static inline u16 virt_queue__pop(struct virt_queue *queue)
 	xen_rmb();
 
 	guest_idx = queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
-	return virtio_guest_to_host_u16(queue, guest_idx);
+	guest_idx = virtio_guest_to_host_u16(queue, guest_idx);
+	if (guest_idx >= queue->vring.num) {
+		pr_warning("virtqueue: invalid head %u", guest_idx);
+		queue->broken = true;
+		return 0;
+	}
+
+	return guest_idx;
 }
 
 static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue, u16 desc_ndx)
@@ -162,10 +221,16 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 {
 	u16 last_avail_idx = virtio_host_to_guest_u16(vq, vq->last_avail_idx);
 
+	if (vq->broken)
+		return false;
+
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
 	if (!vq->vring.avail)
 		return 0;
 
-	if (vq->use_event_idx) {
+	if (vq->use_event_idx && !vq->no_notify) {
 		vring_avail_event(&vq->vring) = last_avail_idx;
 		/*
 		 * After the driver writes a new avail index, it reads the event
@@ -183,10 +248,25 @@ struct vring_used_elem * virt_queue__set_used_elem_no_update(struct virt_queue *
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
-u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
-			u16 *out, u16 *in, struct kvm *kvm);
-u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[],
-			     u16 *out, u16 *in, u16 head, struct kvm *kvm);
+void virt_queue__disable_notify(struct virt_queue *vq);
+bool virt_queue__enable_notify(struct virt_queue *vq);
+/*
+ * *iovp is a malloc()ed array of *iov_cap entries, which is grown to fit
+ * chains of up to iov_max descriptors.
+ *
+ * virt_queue__get_head_iov() returns -EINVAL, and marks the queue broken,
+ * if the chain is malformed. If its buffers can't be mapped it returns
+ * -EFAULT, with only the last descriptor (where the device writes its
+ * status) mapped as the single 'in' segment.
+ */
+u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec **iovp,
+			u16 *iov_cap, u16 *out, u16 *in,
+			struct demu_iov_mapping *map, struct kvm *kvm);
+int virt_queue__get_head_iov(struct virt_queue *vq, struct iovec **iovp,
+			     u16 *iov_cap, u16 *out, u16 *in, u16 head,
+			     struct demu_iov_mapping *map, struct kvm *kvm);
+void virt_queue__put_head_iov(struct virt_queue *vq, struct iovec iov[],
+			      u16 out, u16 in, struct demu_iov_mapping *map);
 u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out);
@@ -205,7 +285,7 @@ struct virtio_device {
 	void			*virtio;
 	struct virtio_ops	*ops;
 	u16			endian;
-	u32			features;
+	u64			features;
 	u32			status;
 };
 
@@ -223,7 +303,12 @@ struct virtio_ops {
 	void (*notify_vq_eventfd)(struct kvm *kvm, void *dev, u32 vq, u32 efd);
 	int (*signal_vq)(struct kvm *kvm, struct virtio_device *vdev, u32 queueid);
 	int (*signal_config)(struct kvm *kvm, struct virtio_device *vdev);
+	/* Set DEVICE_NEEDS_RESET and tell the driver */
+	int (*needs_reset)(struct kvm *kvm, struct virtio_device *vdev);
 	void (*notify_status)(struct kvm *kvm, void *dev, u32 status);
+	/* The guest wrote size bytes at offset of the device config */
+	void (*notify_config)(struct kvm *kvm, void *dev, unsigned long offset,
+			      size_t size);
 	int (*init)(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		    int device_id, int subsys_id, int class, u32 addr, u32 irq);
 	int (*exit)(struct kvm *kvm, struct virtio_device *vdev);
@@ -243,7 +328,7 @@ bool virtio_read_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 bool virtio_write_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 			 unsigned long offset, void *data, size_t size);
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
-			       void *dev, u32 features);
+			       void *dev, u64 features);
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 			  void *dev, u8 status);
 
@@ -0,0 +1,419 @@
+/*
+ * Guest mapping cache.
+ *
+ * Every cached mapping is hashed in each bucket it covers (for frame
+ * lookups, which only look in the bucket of their first frame) and kept
+ * in an rbtree ordered by virtual address (for releases, which only know
+ * the pointer). Mappings without users sit on an LRU list and are the only
+ * candidates for eviction. Stale mappings (see mapcache_invalidate()) are
+ * unhashed, so that they can only be released.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <linux/list.h>
+#include <linux/rbtree.h>
+
+#include "debug.h"
+#include "demu.h"
+#include "mapcache.h"
+
+#include "kvm/util.h"
+
+#define MAPCACHE_HASH_SIZE  1024
+
+struct mapcache_entry;
+
+struct mapcache_link {
+    struct list_head        list;
+    struct mapcache_entry   *entry;
+};
+
+struct mapcache_entry {
+    struct list_head    lru;
+    struct rb_node      node;
+    uint64_t            frame;
+    unsigned int        n;
+    int                 prot;
+    void                *va;
+    unsigned int        refcnt;
+    bool                stale;
+    unsigned int        nr_links;
+    struct mapcache_link    hash[];
+};
+
+struct mapcache {
+    const char                  *name;
+    pthread_mutex_t             lock;
+    const struct mapcache_ops   *ops;
+    void                        *opaque;
+    unsigned int                bucket_shift;
+    uint64_t                    budget;
+    uint64_t                    nr_frames;
+    struct list_head            hash[MAPCACHE_HASH_SIZE];
+    struct list_head            lru;
+    struct rb_root              vas;
+    struct mapcache_stats       stats;
+};
+
+static struct list_head *
+mapcache_bucket(struct mapcache *mc, uint64_t frame)
+{
+    return &mc->hash[(frame >> mc->bucket_shift) % MAPCACHE_HASH_SIZE];
+}
+
+/* The number of buckets frames [frame, frame + n) are hashed in */
+static unsigned int
+mapcache_nr_buckets(struct mapcache *mc, uint64_t frame, unsigned int n)
+{
+    uint64_t    nr;
+
+    nr = ((frame + n - 1) >> mc->bucket_shift) -
+         (frame >> mc->bucket_shift) + 1;
+
+    return nr < MAPCACHE_HASH_SIZE ? nr : MAPCACHE_HASH_SIZE;
+}
+
+static void
+mapcache_hash(struct mapcache *mc, struct mapcache_entry *entry)
+{
+    unsigned int    i;
+
+    for (i = 0; i < entry->nr_links; i++) {
+        uint64_t    frame = entry->frame + ((uint64_t)i << mc->bucket_shift);
+
+        entry->hash[i].entry = entry;
+        list_add(&entry->hash[i].list, mapcache_bucket(mc, frame));
+    }
+}
+
+static void
+mapcache_unhash(struct mapcache_entry *entry)
+{
+    unsigned int    i;
+
+    for (i = 0; i < entry->nr_links; i++)
+        list_del_init(&entry->hash[i].list);
+}
+
+static struct mapcache_entry *
+mapcache_lookup(struct mapcache *mc, uint64_t frame, unsigned int n, int prot)
+{
+    struct mapcache_link    *link;
+
+    list_for_each_entry(link, mapcache_bucket(mc, frame), list) {
+        struct mapcache_entry *entry = link->entry;
+
+        if (frame >= entry->frame &&
+            frame + n <= entry->frame + entry->n &&
+            (entry->prot & prot) == prot)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static struct mapcache_entry *
+mapcache_lookup_va(struct mapcache *mc, void *ptr)
+{
+    struct rb_node  *node = mc->vas.rb_node;
+
+    while (node) {
+        struct mapcache_entry *entry = rb_entry(node, struct mapcache_entry,
+                                                node);
+
+        if (ptr < entry->va)
+            node = node->rb_left;
+        else if (ptr >= entry->va + ((size_t)entry->n << TARGET_PAGE_SHIFT))
+            node = node->rb_right;
+        else
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void
+mapcache_insert_va(struct mapcache *mc, struct mapcache_entry *new)
+{
+    struct rb_node  **link = &mc->vas.rb_node;
+    struct rb_node  *parent = NULL;
+
+    while (*link) {
+        struct mapcache_entry *entry = rb_entry(*link, struct mapcache_entry,
+                                                node);
+
+        parent = *link;
+        if (new->va < entry->va)
+            link = &(*link)->rb_left;
+        else
+            link = &(*link)->rb_right;
+    }
+
+    rb_link_node(&new->node, parent, link);
+    rb_insert_color(&new->node, &mc->vas);
+}
+
+static void
+mapcache_free_entry(struct mapcache *mc, struct mapcache_entry *entry)
+{
+    mapcache_unhash(entry);
+    rb_erase(&entry->node, &mc->vas);
+
+    mc->ops->unmap(entry->va, entry->n, mc->opaque);
+    mc->nr_frames -= entry->n;
+
+    free(entry);
+}
+
+static void
+mapcache_evict(struct mapcache *mc, unsigned int n)
+{
+    struct mapcache_entry   *entry;
+
+    while (mc->nr_frames + n > mc->budget && !list_empty(&mc->lru)) {
+        entry = list_first_entry(&mc->lru, struct mapcache_entry, lru);
+
+        list_del(&entry->lru);
+        mapcache_free_entry(mc, entry);
+        mc->stats.evictions++;
+    }
+}
+
+static struct mapcache_entry *
+mapcache_add(struct mapcache *mc, uint64_t frame, unsigned int n, int prot)
+{
+    struct mapcache_entry   *entry;
+    uint64_t                start, end;
+    uint64_t                bucket = 1ull << mc->bucket_shift;
+    unsigned int            nr_links;
+
+    /* Cover whole buckets so that neighbouring buffers hit too */
+    start = frame & ~(bucket - 1);
+    end = P2ROUNDUP(frame + n, bucket);
+
+    /* Enough links for the exact range too, as it spans the same buckets */
+    nr_links = mapcache_nr_buckets(mc, start, end - start);
+
+    entry = calloc(1, sizeof (*entry) + nr_links * sizeof (entry->hash[0]));
+    if (entry == NULL)
+        return NULL;
+
+    entry->frame = start;
+    entry->n = end - start;
+    entry->prot = prot;
+
+    mapcache_evict(mc, entry->n);
+    if (mc->nr_frames + entry->n > mc->budget)
+        goto fail;
+
+    entry->va = mc->ops->map(entry->frame, entry->n, prot, mc->opaque);
+    if (entry->va == NULL && entry->n != n) {
+        /* Part of the bucket may not be mappable, retry with the exact range */
+        entry->frame = frame;
+        entry->n = n;
+        entry->va = mc->ops->map(entry->frame, entry->n, prot, mc->opaque);
+    }
+    if (entry->va == NULL)
+        goto fail;
+
+    INIT_LIST_HEAD(&entry->lru);
+    entry->nr_links = mapcache_nr_buckets(mc, entry->frame, entry->n);
+    mapcache_hash(mc, entry);
+    mapcache_insert_va(mc, entry);
+    mc->nr_frames += entry->n;
+
+    return entry;
+
+fail:
+    free(entry);
+    return NULL;
+}
+
+void *
+mapcache_map(struct mapcache *mc, uint64_t frame, unsigned int n, int prot)
+{
+    struct mapcache_entry   *entry;
+    void                    *ptr;
+
+    pthread_mutex_lock(&mc->lock);
+
+    entry = mapcache_lookup(mc, frame, n, prot);
+    if (entry) {
+        mc->stats.hits++;
+    } else {
+        mc->stats.misses++;
+
+        entry = mapcache_add(mc, frame, n, prot);
+        if (entry == NULL) {
+            /* Over budget (or out of memory): hand out a private mapping */
+            mc->stats.uncached++;
+            pthread_mutex_unlock(&mc->lock);
+
+            return mc->ops->map(frame, n, prot, mc->opaque);
+        }
+    }
+
+    if (entry->refcnt++ == 0)
+        list_del_init(&entry->lru);
+
+    ptr = entry->va + ((frame - entry->frame) << TARGET_PAGE_SHIFT);
+
+    pthread_mutex_unlock(&mc->lock);
+
+    return ptr;
+}
+
+/*
+ * Returns false if ptr does not belong to the cache, in which case the
+ * caller is responsible for unmapping it.
+ */
+bool
+mapcache_unmap(struct mapcache *mc, void *ptr)
+{
+    struct mapcache_entry   *entry;
+
+    pthread_mutex_lock(&mc->lock);
+
+    entry = mapcache_lookup_va(mc, ptr);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&mc->lock);
+        return false;
+    }
+
+    BUG_ON(entry->refcnt == 0);
+
+    if (--entry->refcnt == 0) {
+        if (entry->stale) {
+            mapcache_free_entry(mc, entry);
+            pthread_mutex_unlock(&mc->lock);
+            return true;
+        }
+
+        list_add_tail(&entry->lru, &mc->lru);
+    }
+
+    pthread_mutex_unlock(&mc->lock);
+
+    return true;
+}
+
+void
+mapcache_invalidate(struct mapcache *mc)
+{
+    struct mapcache_entry   *entry;
+    struct rb_node          *node, *next;
+
+    pthread_mutex_lock(&mc->lock);
+
+    for (node = rb_first(&mc->vas); node; node = next) {
+        next = rb_next(node);
+        entry = rb_entry(node, struct mapcache_entry, node);
+
+        if (entry->stale)
+            continue;
+
+        mc->stats.invalidated++;
+
+        if (entry->refcnt == 0) {
+            list_del(&entry->lru);
+            mapcache_free_entry(mc, entry);
+        } else {
+            mapcache_unhash(entry);
+            entry->stale = true;
+        }
+    }
+
+    pthread_mutex_unlock(&mc->lock);
+}
+
+void
+mapcache_get_stats(struct mapcache *mc, struct mapcache_stats *stats)
+{
+    pthread_mutex_lock(&mc->lock);
+    *stats = mc->stats;
+    pthread_mutex_unlock(&mc->lock);
+}
+
+struct mapcache *
+mapcache_create(const char *name, uint64_t budget, unsigned int bucket_shift,
+                const struct mapcache_ops *ops, void *opaque)
+{
+    struct mapcache *mc;
+    int             i;
+
+    mc = calloc(1, sizeof (*mc));
+    if (mc == NULL)
+        goto fail1;
+
+    mc->name = name;
+    mc->ops = ops;
+    mc->opaque = opaque;
+    mc->bucket_shift = bucket_shift;
+    mc->budget = budget >> TARGET_PAGE_SHIFT;
+
+    for (i = 0; i < MAPCACHE_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&mc->hash[i]);
+    INIT_LIST_HEAD(&mc->lru);
+
+    if (pthread_mutex_init(&mc->lock, NULL) != 0)
+        goto fail2;
+
+    DBG("%s: budget %"PRIu64" frames, bucket %u frames\n", name,
+        mc->budget, 1u << bucket_shift);
+
+    return mc;
+
+fail2:
+    DBG("fail2\n");
+
+    free(mc);
+
+fail1:
+    DBG("fail1\n");
+
+    warn("fail");
+    return NULL;
+}
+
+void
+mapcache_destroy(struct mapcache *mc)
+{
+    struct rb_node  *node;
+
+    if (mc == NULL)
+        return;
+
+    while ((node = rb_first(&mc->vas)) != NULL) {
+        struct mapcache_entry *entry = rb_entry(node, struct mapcache_entry,
+                                                node);
+
+        if (entry->refcnt)
+            DBG("%s: frame 0x%"PRIx64" still has %u user(s)\n", mc->name,
+                entry->frame, entry->refcnt);
+
+        list_del(&entry->lru);
+        mapcache_free_entry(mc, entry);
+    }
+
+    pthread_mutex_destroy(&mc->lock);
+    free(mc);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-tab-always-indent: nil
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,67 @@
+/*
+ * Guest mapping cache.
+ *
+ * Keeps mappings of guest frames alive after the I/O that created them has
+ * completed, so hot guest buffers can be reused without paying a map/unmap
+ * round trip per request. Mappings are looked up by frame number, released
+ * by virtual address and evicted in LRU order once the configured budget is
+ * exceeded.
+ */
+
+#ifndef  _MAPCACHE_H
+#define  _MAPCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct mapcache;
+
+struct mapcache_ops {
+    void    *(*map)(uint64_t frame, unsigned int n, int prot, void *opaque);
+    void    (*unmap)(void *ptr, unsigned int n, void *opaque);
+};
+
+struct mapcache_stats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint64_t    uncached;
+    uint64_t    invalidated;
+};
+
+/*
+ * Frames are grouped into buckets of (1 << bucket_shift) frames and a miss
+ * maps the whole bucket(s) covering the request. Use 0 for frame spaces
+ * which are not contiguous (e.g. grant references).
+ */
+struct mapcache *mapcache_create(const char *name, uint64_t budget,
+                                 unsigned int bucket_shift,
+                                 const struct mapcache_ops *ops,
+                                 void *opaque);
+void    mapcache_destroy(struct mapcache *mc);
+
+void    *mapcache_map(struct mapcache *mc, uint64_t frame, unsigned int n,
+                      int prot);
+bool    mapcache_unmap(struct mapcache *mc, void *ptr);
+
+/*
+ * Drop every cached mapping, e.g. because the frames behind them may have
+ * changed. Mappings still in use are not torn down under their users but
+ * are no longer handed out, and go away once released.
+ */
+void    mapcache_invalidate(struct mapcache *mc);
+
+void    mapcache_get_stats(struct mapcache *mc, struct mapcache_stats *stats);
+
+#endif  /* _MAPCACHE_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * c-tab-always-indent: nil
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,18 +1,21 @@
 #include "kvm/virtio-blk.h"
 
 #include "kvm/disk-image.h"
-#include "kvm/mutex.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/virtio.h"
 
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "../demu.h"
 
@@ -24,64 +27,445 @@
 extern bool virtio_legacy;
 
 /*
- * the header and status consume too entries
+ * Queues are as deep as the guest wants, up to VIRTIO_BLK_QUEUE_MAX. The
+ * request pool is sized from the negotiated value.
  */
-#define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
-#define VIRTIO_BLK_QUEUE_SIZE		256
-#define NUM_VIRT_QUEUES			1
+#define VIRTIO_BLK_QUEUE_MAX		DISK_IO_DEPTH_MAX
+#define VIRTIO_BLK_MAX_QUEUES		16
+
+/*
+ * Requests start with room for VIRTIO_BLK_REQ_IOV_MIN descriptors, grown
+ * as longer chains come in up to seg_max plus the header and status.
+ */
+#define VIRTIO_BLK_REQ_IOV_MIN		64
+
+/* Largest segment when the backend has no transfer size limit */
+#define VIRTIO_BLK_SIZE_MAX		(4U << 20)
+
+/* Ranges in a single DISCARD or WRITE_ZEROES request */
+#define VIRTIO_BLK_DISCARD_SEG_MAX	256
+
+/* The adaptive polling window never shrinks below 1/16th of poll-usecs */
+#define VIRTIO_BLK_POLL_SHRINK		4
 
 struct blk_dev_req {
 	struct virt_queue		*vq;
 	struct blk_dev			*bdev;
-	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+	struct iovec			*iov;
+	u16				iov_cap;
+	struct demu_iov_mapping		map;
 	u16				out, in, head;
 	struct kvm			*kvm;
+	/* Completion queue linkage and result */
+	struct blk_dev_req		*next;
+	long				len;
+	/*
+	 * A request split for the backend is done when its last part is,
+	 * see virtio_blk_split_rw(). parts is 0 for unsplit requests.
+	 */
+	u32				parts;
+	long				parts_len;
+	long				parts_err;
+	struct iovec			*parts_iov;
+	size_t				parts_iov_cap;
+	/* Range of a write, invalidated again in readahead once done */
+	u64				wr_sector;
+	u64				wr_sectors;
 };
 
-struct blk_dev {
-	struct mutex			mutex;
+/*
+ * Each virtqueue has its own requests, doorbell and worker.
+ *
+ * The worker owns the used ring: completing threads only push requests on
+ * the lock-free 'done' list (and ring the doorbell when it was empty), the
+ * worker publishes them with a single used->idx update per batch and
+ * decides on the interrupt. irq_pending counts published completions the
+ * guest has not been interrupted for yet, which the coalescing timer
+ * (irq_tfd) flushes.
+ */
+struct blk_dev_queue {
+	struct blk_dev			*bdev;
+	u32				id;
+
+	/* Negotiated queue size, and as many requests */
+	u16				size;
+	struct blk_dev_req		*reqs;
+
+	struct blk_dev_req		*done;
+	bool				kick;
 
+	u32				irq_pending;
+	int				irq_tfd;
+	bool				irq_armed;
+
+	/* Current polling window, adapted between the bounds of poll_usecs */
+	u64				poll_ns;
+
+	pthread_t			io_thread;
+	int				io_efd;
+	int				io_done;
+};
+
+struct blk_dev {
 	struct list_head		list;
 
 	struct virtio_device		vdev;
 	struct virtio_blk_config	blk_config;
 	struct disk_image		*disk;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	u16				num_queues;
+	struct virt_queue		vqs[VIRTIO_BLK_MAX_QUEUES];
+	struct blk_dev_queue		*queues;
 
-	pthread_t			io_thread;
-	int				io_efd;
-	int				io_done;
+	u32				irq_coalesce_count;
+	u32				irq_coalesce_usecs;
+	u32				poll_usecs;
 
 	struct kvm			*kvm;
 };
 
 static LIST_HEAD(bdevs);
 
+/* The queue served by the current thread, if it is a queue worker */
+static __thread struct blk_dev_queue *blk_queue_owner;
+
+/* Called by the queue owner, returns whether to signal the guest */
+static bool virtio_blk_irq_due(struct blk_dev_queue *queue)
+{
+	struct blk_dev *bdev = queue->bdev;
+	struct itimerspec its = { 0 };
+
+	if (!queue->irq_pending)
+		return false;
+
+	if (bdev->irq_coalesce_usecs &&
+	    (!bdev->irq_coalesce_count ||
+	     queue->irq_pending < bdev->irq_coalesce_count)) {
+		/* Hold it, the timer fires at the latest after the delay */
+		if (!queue->irq_armed) {
+			its.it_value.tv_sec = bdev->irq_coalesce_usecs / 1000000;
+			its.it_value.tv_nsec = (bdev->irq_coalesce_usecs % 1000000) * 1000;
+			if (timerfd_settime(queue->irq_tfd, 0, &its, NULL) == 0) {
+				queue->irq_armed = true;
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+
+	/* A still armed timer finds nothing pending, or a newer batch */
+	queue->irq_pending = 0;
+
+	return virtio_queue__should_signal(&bdev->vqs[queue->id]);
+}
+
+/*
+ * Make the completed requests visible to the guest and maybe interrupt it.
+ * Only called by the queue owner, which is the only consumer of 'done'.
+ */
+static void virtio_blk_reap(struct blk_dev_queue *queue)
+{
+	struct blk_dev *bdev = queue->bdev;
+	struct virt_queue *vq = &bdev->vqs[queue->id];
+	struct blk_dev_req *req, *next, *list = NULL;
+	u16 n = 0;
+
+	req = __atomic_exchange_n(&queue->done, NULL, __ATOMIC_ACQUIRE);
+
+	/* The list is LIFO, restore the completion order */
+	while (req) {
+		next = req->next;
+		req->next = list;
+		list = req;
+		req = next;
+	}
+
+	for (req = list; req; req = next) {
+		/* req may be reused as soon as the guest sees it */
+		next = req->next;
+		virt_queue__set_used_elem_no_update(vq, req->head, req->len, n++);
+	}
+
+	if (n) {
+		virt_queue__used_idx_advance(vq, n);
+		queue->irq_pending += n;
+	}
+
+	if (virtio_blk_irq_due(queue))
+		bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev, queue->id);
+}
+
+static void virtio_blk_kick(struct blk_dev_queue *queue)
+{
+	u64 data = 1;
+
+	if (write(queue->io_efd, &data, sizeof(data)) < 0)
+		pr_warning("failed to kick queue %u", queue->id);
+}
+
+/* Wake up the owners of the queues which got completions in this batch */
+static void virtio_blk_complete_batch(void *param)
+{
+	struct blk_dev *bdev = param;
+	int i;
+
+	for (i = 0; i < bdev->num_queues; i++) {
+		if (__atomic_exchange_n(&bdev->queues[i].kick, false,
+					__ATOMIC_ACQ_REL))
+			virtio_blk_kick(&bdev->queues[i]);
+	}
+}
+
+/*
+ * May be called from any thread. The request goes on its queue's 'done'
+ * list, to be published by virtio_blk_reap(): at the end of
+ * virtio_blk_do_io() for requests completed by the worker itself, or once
+ * the disk's batch callback has kicked the worker for the others.
+ */
 void virtio_blk_complete(void *param, long len)
 {
 	struct blk_dev_req *req = param;
 	struct blk_dev *bdev = req->bdev;
 	int queueid = req->vq - bdev->vqs;
+	struct blk_dev_queue *queue = &bdev->queues[queueid];
 	u8 *status;
 
+	if (__atomic_load_n(&req->parts, __ATOMIC_RELAXED)) {
+		if (len < 0)
+			__atomic_store_n(&req->parts_err, len, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&req->parts_len, len, __ATOMIC_RELAXED);
+
+		if (__atomic_sub_fetch(&req->parts, 1, __ATOMIC_ACQ_REL))
+			return;
+
+		len = req->parts_err ? : req->parts_len;
+	}
+
+	if (req->wr_sectors) {
+		disk_readahead__invalidate(bdev->disk, req->wr_sector,
+					   req->wr_sectors);
+		req->wr_sectors = 0;
+	}
+
 	/* status */
 	status	= req->iov[req->out + req->in - 1].iov_base;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	if (len == -EOPNOTSUPP)
+		*status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
 
-#ifndef MAP_IN_ADVANCE
 	/* Unmap all descriptors */
-	for (int i = 0; i < req->out + req->in; i++)
-		demu_unmap_guest_range(req->iov[i].iov_base, req->iov[i].iov_len);
-#endif
+	virt_queue__put_head_iov(req->vq, req->iov, req->out, req->in, &req->map);
+
+	req->len = len;
+	req->next = __atomic_load_n(&queue->done, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&queue->done, &req->next, req, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+	/* Only the first completion since the last reap needs a wake up */
+	if (!req->next && blk_queue_owner != queue)
+		__atomic_store_n(&queue->kick, true, __ATOMIC_RELEASE);
+}
+
+static void virtio_blk_submit(struct disk_image *disk, bool write, u64 sector,
+			      struct iovec *iov, int iovcount,
+			      struct blk_dev_req *req)
+{
+	if (write)
+		disk_image__write(disk, sector, iov, iovcount, req);
+	else
+		disk_image__read(disk, sector, iov, iovcount, req);
+}
+
+/*
+ * Cut a request bigger than the backend's max_sectors into parts, splitting
+ * the segments which straddle a cut, and submit them all: the disk is
+ * plugged, so they go out together. Every part takes a reference on the
+ * request, the one held here is dropped last so that the request can't
+ * complete before all parts are out.
+ */
+static void virtio_blk_split_rw(struct blk_dev *bdev, struct blk_dev_req *req,
+				bool write, u64 sector, struct iovec *iov,
+				int iovcount, size_t bytes)
+{
+	struct disk_image *disk = bdev->disk;
+	size_t limit = (size_t)disk->max_sectors << SECTOR_SHIFT;
+	size_t need, chunk, len = 0, off = 0;
+	struct iovec *part, *new;
+	int i = 0, n = 0;
+
+	/* Keep the parts aligned, or the host would read-modify-write them */
+	if (limit > disk->phys_block_size)
+		limit -= limit % disk->phys_block_size;
+
+	/* Every cut adds at most one entry */
+	need = iovcount + bytes / limit + 1;
+	if (need > req->parts_iov_cap) {
+		new = realloc(req->parts_iov, need * sizeof(*new));
+		if (!new) {
+			virtio_blk_complete(req, -ENOMEM);
+			return;
+		}
+		req->parts_iov = new;
+		req->parts_iov_cap = need;
+	}
+
+	req->parts_len = 0;
+	req->parts_err = 0;
+	__atomic_store_n(&req->parts, 1, __ATOMIC_RELAXED);
+
+	part = req->parts_iov;
+	while (i < iovcount) {
+		chunk = min(iov[i].iov_len - off, limit - len);
+		part[n].iov_base = iov[i].iov_base + off;
+		part[n].iov_len = chunk;
+		n++;
+		len += chunk;
+		off += chunk;
+
+		if (off == iov[i].iov_len) {
+			i++;
+			off = 0;
+		}
+
+		if (len == limit || i == iovcount) {
+			__atomic_add_fetch(&req->parts, 1, __ATOMIC_RELAXED);
+			virtio_blk_submit(disk, write, sector, part, n, req);
+
+			sector += len >> SECTOR_SHIFT;
+			part += n;
+			n = 0;
+			len = 0;
+		}
+	}
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+	virtio_blk_complete(req, 0);
+}
+
+/*
+ * Reads may be served by the disk's readahead. Writes invalidate it on
+ * submission here, and on completion in virtio_blk_complete().
+ */
+static void virtio_blk_rw(struct blk_dev *bdev, struct blk_dev_req *req,
+			  bool write, u64 sector, struct iovec *iov,
+			  int iovcount)
+{
+	struct disk_image *disk = bdev->disk;
+	u32 max_sectors = disk->max_sectors;
+	size_t bytes = 0;
+	ssize_t len;
+	int i;
+
+	if (disk->readahead) {
+		if (!write) {
+			len = disk_readahead__read(disk, sector, iov, iovcount);
+			if (len > 0) {
+				virtio_blk_complete(req, len);
+				return;
+			}
+		} else {
+			for (i = 0; i < iovcount; i++)
+				bytes += iov[i].iov_len;
+
+			req->wr_sector = sector;
+			req->wr_sectors = DIV_ROUND_UP(bytes, SECTOR_SIZE);
+			disk_readahead__invalidate(disk, req->wr_sector,
+						   req->wr_sectors);
+		}
+	}
+
+	if (max_sectors) {
+		if (!bytes) {
+			for (i = 0; i < iovcount; i++)
+				bytes += iov[i].iov_len;
+		}
+
+		if (bytes > (size_t)max_sectors << SECTOR_SHIFT) {
+			virtio_blk_split_rw(bdev, req, write, sector, iov,
+					    iovcount, bytes);
+			return;
+		}
+	}
+
+	virtio_blk_submit(disk, write, sector, iov, iovcount, req);
+}
+
+/* Copy len bytes at offset off of the iov array into buf */
+static bool virtio_blk_iov_read(const struct iovec *iov, int iovcount,
+				size_t off, void *buf, size_t len)
+{
+	size_t chunk;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
+
+		chunk = min(iov->iov_len - off, len);
+		memcpy(buf, iov->iov_base + off, chunk);
+		buf += chunk;
+		len -= chunk;
+		off = 0;
+	}
+
+	return !len;
+}
+
+/*
+ * DISCARD and WRITE_ZEROES carry a list of ranges, handed to the disk one
+ * after the other by the queue worker.
+ */
+static long virtio_blk_discard(struct blk_dev *bdev, u32 type,
+			       const struct iovec *iov, int iovcount)
+{
+	struct virtio_blk_discard_write_zeroes range;
+	struct disk_image *disk = bdev->disk;
+	bool zeroes = type == VIRTIO_BLK_T_WRITE_ZEROES;
+	u64 capacity = disk->size >> SECTOR_SHIFT;
+	u32 limit, nr, flags;
+	size_t bytes = 0, off;
+	u64 sector;
+	int i, r;
+
+	limit = zeroes ? disk->write_zeroes_max_sectors : disk->discard_max_sectors;
+	if (!limit || disk->readonly)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < iovcount; i++)
+		bytes += iov[i].iov_len;
+
+	if (!bytes || bytes % sizeof(range) ||
+	    bytes / sizeof(range) > VIRTIO_BLK_DISCARD_SEG_MAX)
+		return -EINVAL;
+
+	for (off = 0; off < bytes; off += sizeof(range)) {
+		virtio_blk_iov_read(iov, iovcount, off, &range, sizeof(range));
+
+		sector = le64_to_cpu(range.sector);
+		nr = le32_to_cpu(range.num_sectors);
+		flags = le32_to_cpu(range.flags);
+
+		/* Only write zeroes may unmap */
+		if (flags & ~(zeroes ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0))
+			return -EOPNOTSUPP;
+
+		if (nr > limit || sector > capacity || nr > capacity - sector)
+			return -EINVAL;
+
+		if (zeroes)
+			r = disk_image__write_zeroes(disk, sector, nr,
+					flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+		else
+			r = disk_image__discard(disk, sector, nr);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
@@ -100,6 +484,11 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	out		= req->out;
 	in		= req->in;
 
+	if (!out || iov[0].iov_len < sizeof(*req_hdr)) {
+		virtio_blk_complete(req, -EINVAL);
+		return;
+	}
+
 	req_hdr		= iov[0].iov_base;
 
 	type = virtio_guest_to_host_u32(vq, req_hdr->type);
@@ -107,16 +496,13 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 
 	switch (type) {
 	case VIRTIO_BLK_T_IN:
-		block_cnt = disk_image__read(bdev->disk, sector,
-				iov + 1, in + out - 2, req);
+		virtio_blk_rw(bdev, req, false, sector, iov + 1, in + out - 2);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		block_cnt = disk_image__write(bdev->disk, sector,
-				iov + 1, in + out - 2, req);
+		virtio_blk_rw(bdev, req, true, sector, iov + 1, in + out - 2);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
-		block_cnt = disk_image__flush(bdev->disk);
-		virtio_blk_complete(req, block_cnt);
+		disk_image__flush_async(bdev->disk, req);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
 		block_cnt = VIRTIO_BLK_ID_BYTES;
@@ -124,27 +510,56 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 				(iov + 1)->iov_base, &block_cnt);
 		virtio_blk_complete(req, block_cnt);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		block_cnt = virtio_blk_discard(bdev, type, iov + 1, out - 1);
+		virtio_blk_complete(req, block_cnt);
+		break;
 	default:
 		pr_warning("request type %d", type);
-		block_cnt	= -1;
+		virtio_blk_complete(req, -EOPNOTSUPP);
 		break;
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq,
+			     struct blk_dev_queue *queue)
 {
+	struct blk_dev *bdev = queue->bdev;
 	struct blk_dev_req *req;
 	u16 head;
+	int r;
 
-	while (virt_queue__available(vq) && !bdev->io_done) {
+	/* Let the disk submit everything this notify brought in one go */
+	disk_image__plug(queue->bdev->disk);
+
+	while (virt_queue__available(vq) && !queue->io_done) {
 		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
-		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
+		if (vq->broken) {
+			bdev->vdev.ops->needs_reset(bdev->kvm, &bdev->vdev);
+			break;
+		}
+		req		= &queue->reqs[head];
+		req->head	= head;
 		req->vq		= vq;
-
-		virtio_blk_do_io_request(kvm, vq, req);
+		r = virt_queue__get_head_iov(vq, &req->iov, &req->iov_cap,
+					     &req->out, &req->in, head,
+					     &req->map, kvm);
+		if (r == -EINVAL) {
+			bdev->vdev.ops->needs_reset(bdev->kvm, &bdev->vdev);
+			break;
+		}
+
+		/* Only the status could be mapped */
+		if (r == -EFAULT)
+			virtio_blk_complete(req, -EFAULT);
+		else
+			virtio_blk_do_io_request(kvm, vq, req);
 	}
+
+	disk_image__unplug(queue->bdev->disk);
+
+	virtio_blk_reap(queue);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -159,7 +574,17 @@ static u32 get_host_features(struct kvm *kvm, void *dev)
 	struct blk_dev *bdev = dev;
 
 	return	1UL << VIRTIO_BLK_F_SEG_MAX
+		| 1UL << VIRTIO_BLK_F_SIZE_MAX
+		| 1UL << VIRTIO_BLK_F_BLK_SIZE
+		| 1UL << VIRTIO_BLK_F_TOPOLOGY
 		| 1UL << VIRTIO_BLK_F_FLUSH
+		| (bdev->num_queues > 1 ? 1UL << VIRTIO_BLK_F_MQ : 0)
+		| (bdev->blk_config.max_discard_sectors ?
+		   1UL << VIRTIO_BLK_F_DISCARD : 0)
+		| (bdev->blk_config.max_write_zeroes_sectors ?
+		   1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0)
+		| (bdev->disk->cache_mode != DISK_CACHE_UNSAFE ?
+		   1UL << VIRTIO_BLK_F_CONFIG_WCE : 0)
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 /* XXX */
@@ -169,11 +594,45 @@ static u32 get_host_features(struct kvm *kvm, void *dev)
 		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
 }
 
+/*
+ * Guests which negotiated CONFIG_WCE pick the cache mode through 'wce', the
+ * others get writeback if they know how to flush it and writethrough if not.
+ */
+static void virtio_blk_update_cache(struct blk_dev *bdev)
+{
+	u64 features = bdev->vdev.features;
+	bool writeback;
+
+	if (features & (1ULL << VIRTIO_BLK_F_CONFIG_WCE))
+		writeback = bdev->blk_config.wce;
+	else
+		writeback = features & (1ULL << VIRTIO_BLK_F_FLUSH);
+
+	disk_image__set_writeback(bdev->disk, writeback);
+}
+
+static void notify_config(struct kvm *kvm, void *dev, unsigned long offset,
+			  size_t size)
+{
+	struct blk_dev *bdev = dev;
+
+	if (offset <= offsetof(struct virtio_blk_config, wce) &&
+	    offset + size > offsetof(struct virtio_blk_config, wce))
+		virtio_blk_update_cache(bdev);
+}
+
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
 {
 	struct blk_dev *bdev = dev;
 	struct virtio_blk_config *conf = &bdev->blk_config;
 
+	if (status & VIRTIO__STATUS_START)
+		virtio_blk_update_cache(bdev);
+
+	/* A reset brings back the configured mode */
+	if (status & VIRTIO__STATUS_STOP)
+		conf->wce = bdev->disk->cache_mode != DISK_CACHE_WRITETHROUGH;
+
 	if (!(status & VIRTIO__STATUS_SWAB))
 		return;
 
@@ -188,55 +647,260 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 	conf->blk_size = virtio_host_to_guest_u32(&bdev->vdev, conf->blk_size);
 	conf->min_io_size = virtio_host_to_guest_u16(&bdev->vdev, conf->min_io_size);
 	conf->opt_io_size = virtio_host_to_guest_u32(&bdev->vdev, conf->opt_io_size);
+	conf->num_queues = virtio_host_to_guest_u16(&bdev->vdev, conf->num_queues);
+	conf->max_discard_sectors = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_discard_sectors);
+	conf->max_discard_seg = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_discard_seg);
+	conf->discard_sector_alignment = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->discard_sector_alignment);
+	conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_write_zeroes_sectors);
+	conf->max_write_zeroes_seg = virtio_host_to_guest_u32(&bdev->vdev,
+						conf->max_write_zeroes_seg);
 }
 
-static void *virtio_blk_thread(void *dev)
+/* The coalescing delay is over, the timerfd is non-blocking */
+static void virtio_blk_irq_timer(struct blk_dev_queue *queue)
 {
-	struct blk_dev *bdev = dev;
+	struct blk_dev *bdev = queue->bdev;
+	u64 data;
+
+	if (read(queue->irq_tfd, &data, sizeof(u64)) <= 0)
+		return;
+
+	queue->irq_armed = false;
+	if (queue->irq_pending &&
+	    virtio_queue__should_signal(&bdev->vqs[queue->id]))
+		bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev, queue->id);
+	queue->irq_pending = 0;
+}
+
+static u64 virtio_blk_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Busy poll the ring and the completion list, with guest notifications
+ * suppressed, until the queue has been idle for the polling window. The
+ * window doubles (up to poll-usecs) when polling found work, and halves
+ * when it did not, so idle queues go back to sleeping quickly.
+ */
+static void virtio_blk_poll(struct blk_dev_queue *queue)
+{
+	struct blk_dev *bdev = queue->bdev;
+	struct virt_queue *vq = &bdev->vqs[queue->id];
+	u64 limit = (u64)bdev->poll_usecs * 1000;
+	u64 now, deadline;
+	bool found = false;
+
+	if (!queue->poll_ns)
+		queue->poll_ns = limit;
+
+	virt_queue__disable_notify(vq);
+
+	now = virtio_blk_now();
+	deadline = now + queue->poll_ns;
+
+	while (!queue->io_done && now < deadline) {
+		if (virt_queue__available(vq) ||
+		    __atomic_load_n(&queue->done, __ATOMIC_RELAXED)) {
+			virtio_blk_do_io(bdev->kvm, vq, queue);
+			found = true;
+			deadline = virtio_blk_now() + queue->poll_ns;
+		} else if (queue->irq_armed) {
+			virtio_blk_irq_timer(queue);
+		}
+
+		now = virtio_blk_now();
+	}
+
+	/* The guest may not have notified what came in meanwhile */
+	if (virt_queue__enable_notify(vq))
+		virtio_blk_do_io(bdev->kvm, vq, queue);
+
+	if (found)
+		queue->poll_ns = min(queue->poll_ns * 2, limit);
+	else
+		queue->poll_ns = max(queue->poll_ns / 2,
+				     limit >> VIRTIO_BLK_POLL_SHRINK);
+}
+
+static void *virtio_blk_thread(void *arg)
+{
+	struct blk_dev_queue *queue = arg;
+	struct blk_dev *bdev = queue->bdev;
+	struct pollfd fds[2] = {
+		{ .fd = queue->io_efd, .events = POLLIN },
+		{ .fd = queue->irq_tfd, .events = POLLIN },
+	};
+	char name[16];
 	u64 data;
 	int r;
 
-	kvm__set_thread_name("virtio-blk-io");
+	snprintf(name, sizeof(name), "virtio-blk-io%u", queue->id);
+	kvm__set_thread_name(name);
 
-	while (!bdev->io_done) {
-		r = read(bdev->io_efd, &data, sizeof(u64));
+	blk_queue_owner = queue;
+
+	while (!queue->io_done) {
+		r = poll(fds, queue->irq_tfd < 0 ? 1 : 2, -1);
 		if (r < 0)
 			continue;
-		virtio_blk_do_io(bdev->kvm, &bdev->vqs[0], bdev);
+
+		if (fds[1].revents & POLLIN)
+			virtio_blk_irq_timer(queue);
+
+		/* Both new requests and completions ring the doorbell */
+		if (fds[0].revents & POLLIN &&
+		    read(queue->io_efd, &data, sizeof(u64)) > 0) {
+			virtio_blk_do_io(bdev->kvm, &bdev->vqs[queue->id], queue);
+
+			if (bdev->poll_usecs)
+				virtio_blk_poll(queue);
+		}
 	}
 
 	pthread_exit(NULL);
 	return NULL;
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+/* Spread the workers over the configured CPUs, one CPU per queue */
+static void virtio_blk_pin_thread(struct blk_dev_queue *queue)
+{
+	cpu_set_t *cpus = &queue->bdev->disk->cpus;
+	int nr = CPU_COUNT(cpus);
+	int cpu, n;
+	cpu_set_t set;
+
+	if (nr == 0)
+		return;
+
+	n = queue->id % nr;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, cpus) && n-- == 0)
+			break;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(queue->io_thread, sizeof(set), &set))
+		pr_warning("failed to pin queue %u to CPU %d", queue->id, cpu);
+}
+
+static void virtio_blk_free_reqs(struct blk_dev_queue *queue)
 {
 	unsigned int i;
-	struct blk_dev *bdev = dev;
 
-	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
-			      VIRTIO_BLK_QUEUE_SIZE);
+	if (!queue->reqs)
+		return;
 
-	if (vq != 0)
-		return 0;
+	for (i = 0; i < queue->size; i++) {
+		free(queue->reqs[i].iov);
+		free(queue->reqs[i].parts_iov);
+	}
+
+	free(queue->reqs);
+	queue->reqs = NULL;
+}
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i] = (struct blk_dev_req) {
+static int virtio_blk_alloc_reqs(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	struct blk_dev *bdev = queue->bdev;
+	u16 iov_max = bdev->blk_config.seg_max + 2;
+	u16 iov_cap = min_t(u16, iov_max, VIRTIO_BLK_REQ_IOV_MIN);
+	unsigned int i;
+
+	queue->reqs = calloc(queue->size, sizeof(*queue->reqs));
+	if (!queue->reqs)
+		return -ENOMEM;
+
+	for (i = 0; i < queue->size; i++) {
+		queue->reqs[i] = (struct blk_dev_req) {
 			.bdev = bdev,
+			.iov = calloc(iov_cap, sizeof(struct iovec)),
+			.iov_cap = iov_cap,
 			.kvm = kvm,
 		};
+
+		if (!queue->reqs[i].iov) {
+			virtio_blk_free_reqs(queue);
+			return -ENOMEM;
+		}
+	}
+
+	/* Longer chains are cut short by the virtio core */
+	bdev->vqs[queue->id].iov_max = iov_max;
+
+	return 0;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue;
+	int r;
+
+	if (vq >= bdev->num_queues || !bdev->queues[vq].size)
+		return -EINVAL;
+
+	queue = &bdev->queues[vq];
+	queue->bdev = bdev;
+	queue->id = vq;
+
+	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq], queue->size);
+
+	r = virtio_blk_alloc_reqs(kvm, queue);
+	if (r < 0)
+		return r;
+
+	queue->done = NULL;
+	queue->kick = false;
+	queue->poll_ns = 0;
+	queue->irq_pending = 0;
+	queue->irq_armed = false;
+	queue->io_efd = eventfd(0, 0);
+	if (queue->io_efd < 0) {
+		r = -errno;
+		goto err_free;
 	}
 
-	mutex_init(&bdev->mutex);
-	bdev->io_efd = eventfd(0, 0);
-	if (bdev->io_efd < 0)
-		return -errno;
+	queue->irq_tfd = -1;
+	if (bdev->irq_coalesce_usecs) {
+		queue->irq_tfd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_CLOEXEC | TFD_NONBLOCK);
+		if (queue->irq_tfd < 0) {
+			r = -errno;
+			goto err_close;
+		}
+	}
+
+	queue->io_done = 0;
+	r = pthread_create(&queue->io_thread, NULL, virtio_blk_thread, queue);
+	if (r) {
+		r = -r;
+		if (queue->irq_tfd >= 0)
+			close(queue->irq_tfd);
+		queue->irq_tfd = -1;
+		goto err_close;
+	}
 
-	bdev->io_done = 0;
-	if (pthread_create(&bdev->io_thread, NULL, virtio_blk_thread, bdev))
-		return -errno;
+	virtio_blk_pin_thread(queue);
 
 	return 0;
+
+err_close:
+	close(queue->io_efd);
+	queue->io_efd = -1;
+err_free:
+	virtio_blk_free_reqs(queue);
+	return r;
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq);
@@ -244,16 +908,32 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq);
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue;
+
+	if (vq >= bdev->num_queues)
+		return;
 
-	if (vq != 0)
+	queue = &bdev->queues[vq];
+	if (queue->io_efd < 0)
 		return;
 
-	bdev->io_done = 1;
+	queue->io_done = 1;
 	notify_vq(kvm, dev, vq);
-	pthread_join(bdev->io_thread, NULL);
-	close(bdev->io_efd);
+	pthread_join(queue->io_thread, NULL);
 
+	/* The worker is gone, publish what completes meanwhile ourselves */
 	disk_image__wait(bdev->disk);
+	virtio_blk_reap(queue);
+
+	close(queue->io_efd);
+	queue->io_efd = -1;
+
+	if (queue->irq_tfd >= 0) {
+		close(queue->irq_tfd);
+		queue->irq_tfd = -1;
+	}
+
+	virtio_blk_free_reqs(queue);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -262,7 +942,10 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 	u64 data = 1;
 	int r;
 
-	r = write(bdev->io_efd, &data, sizeof(data));
+	if (vq >= bdev->num_queues)
+		return -EINVAL;
+
+	r = write(bdev->queues[vq].io_efd, &data, sizeof(data));
 	if (r < 0)
 		return r;
 
@@ -278,19 +961,46 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_BLK_QUEUE_SIZE;
+	struct blk_dev *bdev = dev;
+
+	/* A zero size tells the guest the queue does not exist */
+	if (vq >= bdev->num_queues)
+		return 0;
+
+	return VIRTIO_BLK_QUEUE_MAX;
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
+	struct blk_dev *bdev = dev;
+	bool packed = bdev->vdev.features & (1ULL << VIRTIO_F_RING_PACKED);
+
+	if (vq >= bdev->num_queues)
+		return -EINVAL;
+
+	/*
+	 * Split rings must be a power of 2. The ring the driver allocated is
+	 * only that big, so the queue can't be used with any other size: it
+	 * won't get ready until the driver resets the device.
+	 */
+	if (size <= 0 || size > VIRTIO_BLK_QUEUE_MAX ||
+	    (!packed && (size & (size - 1)))) {
+		pr_warning("invalid size %d for queue %u", size, vq);
+		bdev->queues[vq].size = 0;
+		bdev->vdev.ops->needs_reset(kvm, &bdev->vdev);
+		return -EINVAL;
+	}
+
+	bdev->queues[vq].size = size;
+
 	return size;
 }
 
 static int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return NUM_VIRT_QUEUES;
+	struct blk_dev *bdev = dev;
+
+	return bdev->num_queues;
 }
 
 static struct virtio_ops blk_dev_virtio_ops = {
@@ -300,20 +1010,46 @@ static struct virtio_ops blk_dev_virtio_ops = {
 	.init_vq		= init_vq,
 	.exit_vq		= exit_vq,
 	.notify_status		= notify_status,
+	.notify_config		= notify_config,
 	.notify_vq		= notify_vq,
 	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
 };
 
+/*
+ * Guests which know the topology align their requests on physical blocks,
+ * which the data path hands as is to the host, so that neither end ever
+ * reads-modifies-writes. The config counts in logical blocks.
+ */
+static void virtio_blk_set_topology(struct virtio_blk_config *conf,
+				    struct disk_image *disk)
+{
+	u32 lbs = disk->blk_size;
+
+	conf->blk_size = lbs;
+	conf->physical_block_exp = fls_long(disk->phys_block_size / lbs) - 1;
+	conf->alignment_offset = disk->align_offset / lbs;
+	conf->min_io_size = min_t(u32, disk->io_min / lbs, UINT16_MAX);
+	conf->opt_io_size = disk->io_opt / lbs;
+}
+
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
 	struct blk_dev *bdev;
-	int r;
+	u16 num_queues;
+	int i, r;
 
 	if (!disk)
 		return -EINVAL;
 
+	num_queues = disk->num_queues ? : 1;
+	if (num_queues > VIRTIO_BLK_MAX_QUEUES) {
+		pr_warning("%u queues requested, using %u", num_queues,
+			   VIRTIO_BLK_MAX_QUEUES);
+		num_queues = VIRTIO_BLK_MAX_QUEUES;
+	}
+
 	bdev = calloc(1, sizeof(struct blk_dev));
 	if (bdev == NULL)
 		return -ENOMEM;
@@ -322,11 +1058,46 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 		.disk			= disk,
 		.blk_config		= (struct virtio_blk_config) {
 			.capacity	= disk->size / SECTOR_SIZE,
-			.seg_max	= DISK_SEG_MAX,
+			.size_max	= disk->max_sectors ?
+					  disk->max_sectors << SECTOR_SHIFT :
+					  VIRTIO_BLK_SIZE_MAX,
+			.seg_max	= disk->max_segments,
+			.num_queues	= num_queues,
+			.wce		= disk->cache_mode != DISK_CACHE_WRITETHROUGH,
 		},
+		.num_queues		= num_queues,
+		.irq_coalesce_count	= disk->irq_coalesce_count,
+		.irq_coalesce_usecs	= disk->irq_coalesce_usecs,
+		.poll_usecs		= disk->poll_usecs,
 		.kvm			= kvm,
 	};
 
+	virtio_blk_set_topology(&bdev->blk_config, disk);
+
+	/* Zero limits keep the features off, see get_host_features() */
+	if (!disk->readonly) {
+		struct virtio_blk_config *conf = &bdev->blk_config;
+
+		conf->max_discard_sectors = disk->discard_max_sectors;
+		conf->max_discard_seg = VIRTIO_BLK_DISCARD_SEG_MAX;
+		conf->discard_sector_alignment = disk->discard_granularity;
+		conf->max_write_zeroes_sectors = disk->write_zeroes_max_sectors;
+		conf->max_write_zeroes_seg = VIRTIO_BLK_DISCARD_SEG_MAX;
+		conf->write_zeroes_may_unmap = 1;
+	}
+
+	bdev->queues = calloc(num_queues, sizeof(struct blk_dev_queue));
+	if (bdev->queues == NULL) {
+		free(bdev);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_queues; i++) {
+		bdev->queues[i].size = VIRTIO_BLK_QUEUE_MAX;
+		bdev->queues[i].io_efd = -1;
+		bdev->queues[i].irq_tfd = -1;
+	}
+
 	list_add_tail(&bdev->list, &bdevs);
 
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
@@ -337,6 +1108,8 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 		return r;
 
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
+	disk_image__set_batch_callback(bdev->disk, virtio_blk_complete_batch,
+				       bdev);
 
 	return 0;
 }
@@ -345,6 +1118,7 @@ static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 {
 	list_del(&bdev->list);
 	bdev->vdev.ops->exit(kvm, &bdev->vdev);
+	free(bdev->queues);
 	free(bdev);
 
 	return 0;
@@ -20,9 +20,219 @@ const char* virtio_trans_name(enum virtio_trans trans)
 	return "unknown";
 }
 
+static u16 virt_queue__iov_max(struct virt_queue *vq)
+{
+	return vq->iov_max ? : vq->vring.num;
+}
+
+/*
+ * Make room for entry n of a chain in *iov, a malloc()ed array of *cap
+ * entries, growing it up to the queue's iov_max. Returns false if the
+ * chain has to be cut short.
+ */
+static bool virt_queue__iov_reserve(struct virt_queue *vq, struct iovec **iov,
+				    u16 *cap, u16 n)
+{
+	u16 limit = virt_queue__iov_max(vq);
+	struct iovec *new;
+	u16 size;
+
+	if (n < *cap)
+		return true;
+
+	if (n >= limit) {
+		pr_warning("descriptor chain too long");
+		return false;
+	}
+
+	size = min_t(u32, max_t(u32, *cap * 2, n + 1), limit);
+	new = realloc(*iov, size * sizeof(*new));
+	if (!new) {
+		pr_warning("no memory for a %u entries descriptor chain", size);
+		return false;
+	}
+
+	*iov = new;
+	*cap = size;
+
+	return true;
+}
+
+/* Sizes of the split ring areas, including the event index fields */
+static size_t vring_desc_bytes(unsigned int num)
+{
+	return num * sizeof(struct vring_desc);
+}
+
+static size_t vring_avail_bytes(unsigned int num)
+{
+	return sizeof(struct vring_avail) + (num + 1) * sizeof(__virtio16);
+}
+
+static size_t vring_used_bytes(unsigned int num)
+{
+	return sizeof(struct vring_used) +
+	       num * sizeof(struct vring_used_elem) + sizeof(__virtio16);
+}
+
+/* The flags a used descriptor needs for the driver to see it */
+static u16 vring_packed_used_flags(bool wrap)
+{
+	return wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) |
+		      (1 << VRING_PACKED_DESC_F_USED) : 0;
+}
+
+static void vring_packed_step(struct virt_queue *vq, u16 *idx, bool *wrap,
+			      u16 n)
+{
+	*idx += n;
+	if (*idx >= vq->vring.num) {
+		*idx -= vq->vring.num;
+		*wrap = !*wrap;
+	}
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	struct vring_packed *p = &vq->vring_packed;
+	u16 flags;
+
+	if (!p->desc)
+		return false;
+
+	flags = virtio_guest_to_host_u16(vq, p->desc[vq->last_avail_idx].flags);
+
+	return !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) == p->avail_wrap &&
+	       !!(flags & (1 << VRING_PACKED_DESC_F_USED)) != p->avail_wrap;
+}
+
+/*
+ * Consume the next chain, in ring order, and return its buffer id. The
+ * driver makes the head available last, so the whole chain is there.
+ * Callers check vq->broken before using the id.
+ */
+u16 virt_queue__pop_packed(struct virt_queue *vq)
+{
+	struct vring_packed *p = &vq->vring_packed;
+	u16 head = vq->last_avail_idx;
+	u16 n = 0, flags, id;
+
+	/* Read the descriptors only after their flags said they're available */
+	xen_rmb();
+
+	do {
+		flags = virtio_guest_to_host_u16(vq, p->desc[vq->last_avail_idx].flags);
+		id = virtio_guest_to_host_u16(vq, p->desc[vq->last_avail_idx].id);
+		n++;
+		vring_packed_step(vq, &vq->last_avail_idx, &p->avail_wrap, 1);
+	} while ((flags & VRING_DESC_F_NEXT) && n < vq->vring.num);
+
+	if (id >= vq->vring.num) {
+		pr_warning("virtqueue: invalid buffer id %u", id);
+		vq->broken = true;
+		return 0;
+	}
+
+	p->chain_head[id] = head;
+	p->chain_len[id] = n;
+
+	return id;
+}
+
+/*
+ * Used descriptors of a batch only get their id and len written here. The
+ * flags, which hand them over to the driver, are all set by
+ * virt_queue__used_idx_advance() behind a single barrier.
+ */
+static void virt_queue__set_used_elem_packed(struct virt_queue *vq, u32 id,
+					     u32 len, u16 offset)
+{
+	struct vring_packed *p = &vq->vring_packed;
+	struct vring_packed_desc *desc;
+
+	if (offset == 0) {
+		p->batch_idx = p->used_idx;
+		p->batch_wrap = p->used_wrap;
+	}
+
+	desc = &p->desc[p->batch_idx];
+	desc->id = virtio_host_to_guest_u16(vq, id);
+	desc->len = virtio_host_to_guest_u32(vq, len);
+	p->used_len[p->batch_idx] = p->chain_len[id];
+
+	vring_packed_step(vq, &p->batch_idx, &p->batch_wrap, p->chain_len[id]);
+}
+
+static void virt_queue__used_idx_advance_packed(struct virt_queue *vq, u16 jump)
+{
+	struct vring_packed *p = &vq->vring_packed;
+	u16 idx = p->used_idx, first = p->used_idx;
+	bool wrap = p->used_wrap, first_wrap = p->used_wrap;
+	u16 i;
+
+	if (!jump)
+		return;
+
+	/* id and len of every used descriptor before any of the flags */
+	xen_wmb();
+
+	for (i = 0; i < jump; i++) {
+		/* The driver stops at the first one, which goes last */
+		if (i)
+			p->desc[idx].flags = virtio_host_to_guest_u16(vq,
+						vring_packed_used_flags(wrap));
+		vring_packed_step(vq, &idx, &wrap, p->used_len[idx]);
+	}
+
+	xen_wmb();
+	p->desc[first].flags = virtio_host_to_guest_u16(vq,
+					vring_packed_used_flags(first_wrap));
+
+	p->used_idx = idx;
+	p->used_wrap = wrap;
+}
+
+static bool virtio_queue__should_signal_packed(struct virt_queue *vq)
+{
+	struct vring_packed *p = &vq->vring_packed;
+	u16 flags, off_wrap, old, new;
+	bool valid;
+	int off;
+
+	/* See virtio_queue__should_signal() */
+	xen_mb();
+
+	flags = virtio_guest_to_host_u16(vq, p->driver->flags);
+	off_wrap = virtio_guest_to_host_u16(vq, p->driver->off_wrap);
+
+	old = p->signalled_used;
+	new = p->signalled_used = p->used_idx;
+	valid = p->signalled_used_valid;
+	p->signalled_used_valid = true;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+		return true;
+
+	/* VRING_PACKED_EVENT_FLAG_DESC */
+	off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (p->used_wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR)
+		off -= vq->vring.num;
+
+	return !valid || vring_need_event(off, new, old);
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 {
-	u16 idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+	u16 idx;
+
+	if (queue->packed) {
+		virt_queue__used_idx_advance_packed(queue, jump);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
 
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
@@ -39,8 +249,14 @@ virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
 				    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+	u16 idx;
 
+	if (queue->packed) {
+		virt_queue__set_used_elem_packed(queue, head, len, offset);
+		return NULL;
+	}
+
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
 	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
 	used_elem->id	= virtio_host_to_guest_u32(queue, head);
@@ -85,15 +301,112 @@ static unsigned next_desc(struct virt_queue *vq, struct vring_desc *desc,
 	return min(next, max);
 }
 
-u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
+/*
+ * Map the chain collected in iov. If that fails, map the last descriptor
+ * alone so that the request can still be failed through its status.
+ */
+static int virt_queue__map_head_iov(struct virt_queue *vq, struct iovec *iov,
+				    u16 *out, u16 *in,
+				    struct demu_iov_mapping *map)
+{
+	struct iovec status;
+	u64 addr;
+
+	/* Devices write their status at the end of the chain */
+	if (!*in || !iov[*out + *in - 1].iov_len) {
+		pr_warning("virtqueue: chain without room for a status");
+		vq->broken = true;
+		return -EINVAL;
+	}
+
+	status = iov[*out + *in - 1];
+	if (!demu_map_guest_iov(map, iov, *out, *in))
+		return 0;
+
+	addr = (u64)(unsigned long)status.iov_base;
+	iov[0].iov_base = demu_map_guest_range(addr, status.iov_len, PROT_WRITE);
+	iov[0].iov_len = status.iov_len;
+	if (!iov[0].iov_base) {
+		pr_warning("virtqueue: can't map buffer at 0x%llx",
+			   (unsigned long long)addr);
+		vq->broken = true;
+		return -EINVAL;
+	}
+
+	*out = 0;
+	*in = 1;
+	return -EFAULT;
+}
+
+static int virt_queue__get_head_iov_packed(struct virt_queue *vq,
+					   struct iovec **iovp, u16 *iov_cap,
+					   u16 *out, u16 *in, u16 id,
+					   struct demu_iov_mapping *map)
+{
+	struct vring_packed_desc *desc = vq->vring_packed.desc;
+	u16 idx = vq->vring_packed.chain_head[id];
+	u16 n = vq->vring_packed.chain_len[id];
+	struct iovec *iov;
+	u32 mapped = 0;
+	u16 i;
+
+	*out = *in = 0;
+
+	if (virtio_guest_to_host_u16(vq, desc[idx].flags) & VRING_DESC_F_INDIRECT) {
+		mapped = virtio_guest_to_host_u32(vq, desc[idx].len);
+		/* Bounded by iov_max rather than by the ring size */
+		n = min_t(u32, mapped / sizeof(*desc),
+			  virt_queue__iov_max(vq) + 1);
+		desc = n ? demu_map_guest_range(virtio_guest_to_host_u64(vq, desc[idx].addr),
+						mapped, PROT_READ) : NULL;
+		if (!desc) {
+			pr_warning("virtqueue: bad indirect table");
+			vq->broken = true;
+			return -EINVAL;
+		}
+		idx = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!virt_queue__iov_reserve(vq, iovp, iov_cap, *out + *in))
+			break;
+
+		iov = *iovp;
+		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq, desc[idx].len);
+		/* Collect guest addresses, the whole chain is mapped below */
+		iov[*out + *in].iov_base = (void *)(unsigned long)
+				virtio_guest_to_host_u64(vq, desc[idx].addr);
+
+		if (virtio_guest_to_host_u16(vq, desc[idx].flags) & VRING_DESC_F_WRITE)
+			(*in)++;
+		else
+			(*out)++;
+
+		/* An indirect table does not wrap */
+		if (++idx == vq->vring.num && !mapped)
+			idx = 0;
+	}
+
+	if (mapped)
+		demu_unmap_guest_range(desc, mapped);
+
+	return virt_queue__map_head_iov(vq, *iovp, out, in, map);
+}
+
+int virt_queue__get_head_iov(struct virt_queue *vq, struct iovec **iovp, u16 *iov_cap,
+			     u16 *out, u16 *in, u16 head,
+			     struct demu_iov_mapping *map, struct kvm *kvm)
 {
 	struct vring_desc *desc;
+	struct iovec *iov;
 	bool is_write;
 	u16 idx;
 	u16 max;
-#ifndef MAP_IN_ADVANCE
 	u32 mapped = 0;
-#endif
+
+	if (vq->packed)
+		return virt_queue__get_head_iov_packed(vq, iovp, iov_cap, out, in,
+						       head, map);
 
 	idx = head;
 	*out = *in = 0;
@@ -102,31 +415,29 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 
 	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
 		max = virtio_guest_to_host_u32(vq, desc[idx].len) / sizeof(struct vring_desc);
-#ifndef MAP_IN_ADVANCE
 		mapped = virtio_guest_to_host_u32(vq, desc[idx].len);
-		desc = demu_map_guest_range(virtio_guest_to_host_u64(vq, desc[idx].addr),
-				virtio_guest_to_host_u32(vq, desc[idx].len), PROT_READ);
-#else
-		desc = demu_get_host_addr(virtio_guest_to_host_u64(vq, desc[idx].addr));
-#endif
+		desc = max ? demu_map_guest_range(virtio_guest_to_host_u64(vq, desc[idx].addr),
+				virtio_guest_to_host_u32(vq, desc[idx].len), PROT_READ) : NULL;
+		if (!desc) {
+			pr_warning("virtqueue: bad indirect table");
+			vq->broken = true;
+			return -EINVAL;
+		}
 		idx = 0;
 	}
 
 	do {
+		if (!virt_queue__iov_reserve(vq, iovp, iov_cap, *out + *in))
+			break;
+
+		iov = *iovp;
 		is_write = virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE);
 
 		/* Grab the first descriptor, and check it's OK. */
 		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq, desc[idx].len);
-		/* Map all descriptors */
-#ifndef MAP_IN_ADVANCE
-		iov[*out + *in].iov_base = demu_map_guest_range(
-				virtio_guest_to_host_u64(vq, desc[idx].addr),
-				virtio_guest_to_host_u32(vq, desc[idx].len),
-				is_write ? PROT_WRITE : PROT_READ);
-#else
-		iov[*out + *in].iov_base = demu_get_host_addr(
-				virtio_guest_to_host_u64(vq, desc[idx].addr));
-#endif
+		/* Collect guest addresses, the whole chain is mapped below */
+		iov[*out + *in].iov_base = (void *)(unsigned long)
+				virtio_guest_to_host_u64(vq, desc[idx].addr);
 
 		/* If this is an input descriptor, increment that count. */
 		if (is_write)
@@ -135,21 +446,30 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 			(*out)++;
 	} while ((idx = next_desc(vq, desc, idx, max)) != max);
 
-#ifndef MAP_IN_ADVANCE
-	if (desc && mapped)
+	if (mapped)
 		demu_unmap_guest_range(desc, mapped);
-#endif
 
-	return head;
+	return virt_queue__map_head_iov(vq, *iovp, out, in, map);
 }
 
-u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, struct kvm *kvm)
+void virt_queue__put_head_iov(struct virt_queue *vq, struct iovec iov[], u16 out, u16 in,
+			      struct demu_iov_mapping *map)
+{
+	demu_unmap_guest_iov(map, iov, out + in);
+}
+
+u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec **iovp, u16 *iov_cap,
+			u16 *out, u16 *in, struct demu_iov_mapping *map,
+			struct kvm *kvm)
 {
 	u16 head;
 
 	head = virt_queue__pop(vq);
+	if (vq->broken ||
+	    virt_queue__get_head_iov(vq, iovp, iov_cap, out, in, head, map, kvm) == -EINVAL)
+		*out = *in = 0;
 
-	return virt_queue__get_head_iov(vq, iov, out, in, head, kvm);
+	return head;
 }
 
 /* in and out are relative to guest */
@@ -162,26 +482,20 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 
 	idx = head = virt_queue__pop(queue);
 	*out = *in = 0;
+	if (queue->broken)
+		return head;
 	do {
 		u64 addr;
 		desc = virt_queue__get_desc(queue, idx);
 		addr = virtio_guest_to_host_u64(queue, desc->addr);
 		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE)) {
-#ifndef MAP_IN_ADVANCE
 			in_iov[*in].iov_base = demu_map_guest_range(addr,
 					virtio_guest_to_host_u32(queue, desc->len), PROT_WRITE);
-#else
-			in_iov[*in].iov_base = demu_get_host_addr(addr);
-#endif
 			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue, desc->len);
 			(*in)++;
 		} else {
-#ifndef MAP_IN_ADVANCE
 			out_iov[*out].iov_base = demu_map_guest_range(addr,
 					virtio_guest_to_host_u32(queue, desc->len), PROT_READ);
-#else
-			out_iov[*out].iov_base = demu_get_host_addr(addr);
-#endif
 			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue, desc->len);
 			(*out)++;
 		}
@@ -200,16 +514,40 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 	struct vring_addr *addr = &vq->vring_addr;
 
 	vq->endian		= vdev->endian;
-	vq->use_event_idx	= (vdev->features & VIRTIO_RING_F_EVENT_IDX);
+	vq->use_event_idx	= !!(vdev->features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+	vq->packed		= !addr->legacy &&
+				  (vdev->features & (1ULL << VIRTIO_F_RING_PACKED));
 	vq->enabled		= true;
+	vq->no_notify		= false;
 
-	if (addr->legacy) {
+	if (vq->packed) {
+		struct vring_packed *p = &vq->vring_packed;
+		u64 desc = (u64)addr->desc_hi << 32 | addr->desc_lo;
+		u64 driver = (u64)addr->avail_hi << 32 | addr->avail_lo;
+		u64 device = (u64)addr->used_hi << 32 | addr->used_lo;
+
+		vq->vring.num = nr_descs;
+		*p = (struct vring_packed) {
+			.desc		= demu_map_guest_range(desc,
+						nr_descs * sizeof(*p->desc),
+						PROT_READ | PROT_WRITE),
+			.driver		= demu_map_guest_range(driver,
+						sizeof(*p->driver), PROT_READ | PROT_WRITE),
+			.device		= demu_map_guest_range(device,
+						sizeof(*p->device), PROT_READ | PROT_WRITE),
+			.avail_wrap	= true,
+			.used_wrap	= true,
+			.chain_head	= calloc(nr_descs, sizeof(u16)),
+			.chain_len	= calloc(nr_descs, sizeof(u16)),
+			.used_len	= calloc(nr_descs, sizeof(u16)),
+		};
+		BUG_ON(!p->desc);
+		BUG_ON(!p->driver);
+		BUG_ON(!p->device);
+		BUG_ON(!p->chain_head || !p->chain_len || !p->used_len);
+	} else if (addr->legacy) {
 		unsigned long base = (u64)addr->pfn * addr->pgsize;
-#ifndef MAP_IN_ADVANCE
 		void *p = demu_map_guest_range(base, vring_size(nr_descs, addr->align), PROT_READ | PROT_WRITE);
-#else
-		void *p = demu_get_host_addr(base);
-#endif
 		BUG_ON(!p);
 
 		vring_init(&vq->vring, nr_descs, p, addr->align);
@@ -219,15 +557,12 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 		u64 used = (u64)addr->used_hi << 32 | addr->used_lo;
 
 		vq->vring = (struct vring) {
-#ifndef MAP_IN_ADVANCE
-			.desc	= demu_map_guest_range(desc, PAGE_SIZE, PROT_READ | PROT_WRITE),
-			.used	= demu_map_guest_range(used, PAGE_SIZE, PROT_READ | PROT_WRITE),
-			.avail	= demu_map_guest_range(avail, PAGE_SIZE, PROT_READ | PROT_WRITE),
-#else
-			.desc	= demu_get_host_addr(desc),
-			.used	= demu_get_host_addr(used),
-			.avail	= demu_get_host_addr(avail),
-#endif
+			.desc	= demu_map_guest_range(desc, vring_desc_bytes(nr_descs),
+						       PROT_READ | PROT_WRITE),
+			.used	= demu_map_guest_range(used, vring_used_bytes(nr_descs),
+						       PROT_READ | PROT_WRITE),
+			.avail	= demu_map_guest_range(avail, vring_avail_bytes(nr_descs),
+						       PROT_READ | PROT_WRITE),
 			.num	= nr_descs,
 		};
 		BUG_ON(!vq->vring.desc);
@@ -245,16 +580,27 @@ void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 		if (vdev->ops->exit_vq)
 			vdev->ops->exit_vq(kvm, dev, num);
 
-#ifndef MAP_IN_ADVANCE
-		if (vq->vring_addr.legacy)
+		if (vq->packed) {
+			struct vring_packed *p = &vq->vring_packed;
+
+			demu_unmap_guest_range(p->desc,
+					vq->vring.num * sizeof(*p->desc));
+			demu_unmap_guest_range(p->driver, sizeof(*p->driver));
+			demu_unmap_guest_range(p->device, sizeof(*p->device));
+			free(p->chain_head);
+			free(p->chain_len);
+			free(p->used_len);
+		} else if (vq->vring_addr.legacy)
 			demu_unmap_guest_range(vq->vring.desc,
 					vring_size(vq->vring.num, vq->vring_addr.align));
 		else {
-			demu_unmap_guest_range(vq->vring.desc, PAGE_SIZE);
-			demu_unmap_guest_range(vq->vring.used, PAGE_SIZE);
-			demu_unmap_guest_range(vq->vring.avail, PAGE_SIZE);
+			demu_unmap_guest_range(vq->vring.desc,
+					vring_desc_bytes(vq->vring.num));
+			demu_unmap_guest_range(vq->vring.used,
+					vring_used_bytes(vq->vring.num));
+			demu_unmap_guest_range(vq->vring.avail,
+					vring_avail_bytes(vq->vring.num));
 		}
-#endif
 	}
 	memset(vq, 0, sizeof(*vq));
 }
@@ -277,6 +623,9 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
+	if (vq->packed)
+		return virtio_queue__should_signal_packed(vq);
+
 	/*
 	 * Use mb to assure used idx has been increased before we signal the
 	 * guest, and we don't read a stale value for used_event. Without a mb
@@ -306,8 +655,61 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+/*
+ * Ask the guest not to notify us about new buffers, because we are going to
+ * poll the ring. With VIRTIO_RING_F_EVENT_IDX the guest ignores the flag:
+ * leaving avail_event behind last_avail_idx does the same.
+ */
+void virt_queue__disable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	if (vq->no_notify)
+		return;
+
+	vq->no_notify = true;
+
+	if (vq->packed) {
+		vq->vring_packed.device->flags = virtio_host_to_guest_u16(vq,
+					VRING_PACKED_EVENT_FLAG_DISABLE);
+	} else if (!vq->use_event_idx) {
+		flags = virtio_guest_to_host_u16(vq, vq->vring.used->flags);
+		flags |= VRING_USED_F_NO_NOTIFY;
+		vq->vring.used->flags = virtio_host_to_guest_u16(vq, flags);
+	}
+}
+
+/*
+ * Returns true if buffers were made available while notifications were
+ * disabled, in which case the guest may not notify us about them.
+ */
+bool virt_queue__enable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	if (!vq->no_notify)
+		return false;
+
+	vq->no_notify = false;
+
+	if (vq->packed) {
+		vq->vring_packed.device->flags = virtio_host_to_guest_u16(vq,
+					VRING_PACKED_EVENT_FLAG_ENABLE);
+		xen_mb();
+	} else if (!vq->use_event_idx) {
+		flags = virtio_guest_to_host_u16(vq, vq->vring.used->flags);
+		flags &= ~VRING_USED_F_NO_NOTIFY;
+		vq->vring.used->flags = virtio_host_to_guest_u16(vq, flags);
+		/* Pairs with the guest checking the flag after updating idx */
+		xen_mb();
+	}
+
+	/* Publishes avail_event with event idx */
+	return virt_queue__available(vq);
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
-			       void *dev, u32 features)
+			       void *dev, u64 features)
 {
 	/* TODO: fail negotiation if features & ~host_features */
 
@@ -348,6 +750,10 @@ void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 
 	if (vdev->ops->notify_status)
 		vdev->ops->notify_status(kvm, dev, ext_status);
+
+	/* The queues are gone on stop, so are the grants they used */
+	if (ext_status & (VIRTIO__STATUS_START | VIRTIO__STATUS_STOP))
+		demu_frontend_started(ext_status & VIRTIO__STATUS_START);
 }
 
 bool virtio_read_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
@@ -391,6 +797,9 @@ bool virtio_write_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 		return false;
 	}
 
+	if (vdev->ops->notify_config)
+		vdev->ops->notify_config(kvm, dev, offset, size);
+
 	return true;
 }
 
@@ -416,6 +825,7 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		vdev->ops			= ops;
 		vdev->ops->signal_vq		= virtio_mmio_signal_vq;
 		vdev->ops->signal_config	= virtio_mmio_signal_config;
+		vdev->ops->needs_reset		= virtio_mmio_needs_reset;
 		vdev->ops->init			= virtio_mmio_init;
 		vdev->ops->exit			= virtio_mmio_exit;
 		vdev->ops->reset		= virtio_mmio_reset;
@@ -117,7 +117,7 @@ static void virtio_mmio_config_out(
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
 		val = ioport__read32(data);
-		vmmio->hdr.interrupt_state &= ~val;
+		virtio_mmio_irq_ack(vmmio, val);
 		break;
 	default:
 		break;
@@ -131,14 +131,27 @@ void virtio_mmio_legacy_callback(u64 addr, u8 *data,
 	struct virtio_mmio *vmmio = vdev->virtio;
 	u32 offset = addr - vmmio->addr;
 
+	/* See virtio_mmio_modern_callback() */
+	if (is_write && offset == VIRTIO_MMIO_QUEUE_NOTIFY && len == 4) {
+		down_read(&vmmio->lock);
+		virtio_mmio_config_out(offset, data, len, ptr);
+		up_read(&vmmio->lock);
+		return;
+	}
+
+	down_write(&vmmio->lock);
+
 	if (offset >= VIRTIO_MMIO_CONFIG) {
 		offset -= VIRTIO_MMIO_CONFIG;
 		virtio_mmio_device_specific(offset, data, len, is_write, ptr);
-		return;
+		goto out;
 	}
 
 	if (is_write)
 		virtio_mmio_config_out(offset, data, len, ptr);
 	else
 		virtio_mmio_config_in(offset, data, len, ptr);
+
+out:
+	up_write(&vmmio->lock);
 }
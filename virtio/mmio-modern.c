@@ -12,7 +12,8 @@ static void virtio_mmio_config_in(
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 	u64 features = 1ULL << VIRTIO_F_VERSION_1 |
-				   1ULL << VIRTIO_F_ACCESS_PLATFORM;
+				   1ULL << VIRTIO_F_ACCESS_PLATFORM |
+				   1ULL << VIRTIO_F_RING_PACKED;
 	u32 val = 0;
 
 	switch (addr) {
@@ -85,12 +86,16 @@ static void virtio_mmio_config_out(
 		virtio_notify_status(kvm, vdev, vmmio->dev, val);
 		break;
 	case VIRTIO_MMIO_DRIVER_FEATURES:
-		if (vmmio->hdr.guest_features_sel == 0)
+		if (vmmio->hdr.guest_features_sel == 0) {
 			virtio_set_guest_features(vmmio->kvm, vdev, vmmio->dev,
-						  val);
-		else if (vmmio->hdr.guest_features_sel == 1 &&
-			 !((u64)val << 32 & features))
-			pr_warning("guest does not support modern virtio");
+						  (vdev->features & ~0xffffffffULL) | val);
+		} else if (vmmio->hdr.guest_features_sel == 1) {
+			if (!((u64)val << 32 & features))
+				pr_warning("guest does not support modern virtio");
+			virtio_set_guest_features(vmmio->kvm, vdev, vmmio->dev,
+						  (vdev->features & 0xffffffffULL) |
+						  (u64)val << 32);
+		}
 		break;
 	case VIRTIO_MMIO_QUEUE_NUM:
 		vmmio->hdr.queue_num = val;
@@ -107,7 +112,7 @@ static void virtio_mmio_config_out(
 		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
-		vmmio->hdr.interrupt_state &= ~val;
+		virtio_mmio_irq_ack(vmmio, val);
 		break;
 	case VIRTIO_MMIO_QUEUE_DESC_LOW:
 		vmmio_selected_vq(vmmio)->vring_addr.desc_lo = val;
@@ -139,20 +144,37 @@ void virtio_mmio_modern_callback(u64 addr, u8 *data,
 	struct virtio_mmio *vmmio = vdev->virtio;
 	u32 offset = addr - vmmio->addr;
 
+	/*
+	 * Doorbells only kick the device, let them through without waiting
+	 * for another vCPU's register access. A reset still waits for them,
+	 * as it closes what they kick.
+	 */
+	if (is_write && offset == VIRTIO_MMIO_QUEUE_NOTIFY && len == 4) {
+		down_read(&vmmio->lock);
+		virtio_mmio_config_out(offset, (void *)data, len, ptr);
+		up_read(&vmmio->lock);
+		return;
+	}
+
+	down_write(&vmmio->lock);
+
 	if (offset >= VIRTIO_MMIO_CONFIG) {
 		offset -= VIRTIO_MMIO_CONFIG;
 		virtio_mmio_device_specific(offset, data, len, is_write, ptr);
-		return;
+		goto out;
 	}
 
 	if (len != 4) {
 		pr_debug("Invalid %s size %d at 0x%llx", is_write ? "write" :
 			 "read", len, addr);
-		return;
+		goto out;
 	}
 
 	if (is_write)
 		virtio_mmio_config_out(offset, (void *)data, len, ptr);
 	else
 		virtio_mmio_config_in(offset, (void *)data, len, ptr);
+
+out:
+	up_write(&vmmio->lock);
 }
@@ -14,9 +14,32 @@
  * virtio-blk can operate without it, not sure about other virtio backends.
  */
 
-static void kvm__irq_trigger(struct kvm *kvm, int irq)
+/* Only the 0 -> non-zero transition of interrupt_state raises the line */
+static void virtio_mmio_irq_raise(struct virtio_mmio *vmmio, u32 bits)
 {
-	demu_set_irq(irq, VIRTIO_IRQ_HIGH);
+	mutex_lock(&vmmio->irq_lock);
+	if (vmmio->hdr.interrupt_state) {
+		vmmio->irq_suppressed++;
+	} else {
+		vmmio->irq_issued++;
+		demu_set_irq(vmmio->irq, VIRTIO_IRQ_HIGH);
+	}
+	vmmio->hdr.interrupt_state |= bits;
+	mutex_unlock(&vmmio->irq_lock);
+}
+
+/* ... and the non-zero -> 0 transition lowers it */
+void virtio_mmio_irq_ack(struct virtio_mmio *vmmio, u32 val)
+{
+	mutex_lock(&vmmio->irq_lock);
+	if (vmmio->hdr.interrupt_state) {
+		vmmio->hdr.interrupt_state &= ~val;
+		if (!vmmio->hdr.interrupt_state) {
+			vmmio->irq_issued++;
+			demu_set_irq(vmmio->irq, VIRTIO_IRQ_LOW);
+		}
+	}
+	mutex_unlock(&vmmio->irq_lock);
 }
 
 #if 0
@@ -73,8 +96,7 @@ int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 
-	vmmio->hdr.interrupt_state |= VIRTIO_MMIO_INT_VRING;
-	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
+	virtio_mmio_irq_raise(vmmio, VIRTIO_MMIO_INT_VRING);
 
 	return 0;
 }
@@ -107,8 +129,21 @@ int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 
-	vmmio->hdr.interrupt_state |= VIRTIO_MMIO_INT_CONFIG;
-	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
+	virtio_mmio_irq_raise(vmmio, VIRTIO_MMIO_INT_CONFIG);
+
+	return 0;
+}
+
+/* May be called from any thread, only the first call interrupts the guest */
+int virtio_mmio_needs_reset(struct kvm *kvm, struct virtio_device *vdev)
+{
+	struct virtio_mmio *vmmio = vdev->virtio;
+	u32 old;
+
+	old = __atomic_fetch_or(&vmmio->hdr.status, VIRTIO_CONFIG_S_NEEDS_RESET,
+				__ATOMIC_RELAXED);
+	if (!(old & VIRTIO_CONFIG_S_NEEDS_RESET))
+		virtio_mmio_irq_raise(vmmio, VIRTIO_MMIO_INT_CONFIG);
 
 	return 0;
 }
@@ -132,6 +167,7 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 {
 	bool legacy = vdev->legacy;
 	struct virtio_mmio *vmmio = vdev->virtio;
+	pthread_rwlockattr_t attr;
 	int r;
 
 	vmmio->addr	= addr;
@@ -139,6 +175,14 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	vmmio->kvm	= kvm;
 	vmmio->dev	= dev;
 
+	pthread_rwlockattr_init(&attr);
+	/* Don't let a stream of notifies hold off a reset */
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&vmmio->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	mutex_init(&vmmio->irq_lock);
+
 	if (!legacy)
 		vdev->endian = VIRTIO_ENDIAN_LE;
 
@@ -176,6 +220,9 @@ int virtio_mmio_reset(struct kvm *kvm, struct virtio_device *vdev)
 	for (vq = 0; vq < vdev->ops->get_vq_count(kvm, vmmio->dev); vq++)
 		virtio_mmio_exit_vq(kvm, vdev, vq);
 
+	/* Nothing can be pending on a reset device */
+	virtio_mmio_irq_ack(vmmio, ~0U);
+
 	return 0;
 }
 
@@ -186,5 +233,9 @@ int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev)
 	virtio_mmio_reset(kvm, vdev);
 	demu_deregister_memory_space(vmmio->addr);
 
+	pr_info("virtio-mmio@0x%x: %llu irq hypercalls, %llu suppressed",
+		vmmio->addr, (unsigned long long)vmmio->irq_issued,
+		(unsigned long long)vmmio->irq_suppressed);
+
 	return 0;
 }